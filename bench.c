@@ -0,0 +1,369 @@
+/* bench.c: nrfdude throughput benchmarks against the simulated loader
+ *
+ * Copyright (C) 2012 Tristan Willy <tristan.willy at gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include "ihex.h"
+#include "nrf.h"
+#include "sim.h"
+
+#define DEFAULT_SPEC        "latency=125,xfer=20,erase=20000"
+
+
+/* one benchmark result, printed as a line of JSON */
+struct bench_result {
+    const char *op;
+    int iterations;
+    double seconds;         /* per iteration */
+    unsigned long blocks;   /* per iteration */
+    unsigned long pages;    /* per iteration */
+    unsigned long bytes;    /* per iteration, for the ihex routines */
+    unsigned long round_trips;
+    unsigned long transfers;
+    unsigned p50_us, p99_us;
+    unsigned long retries;  /* over all iterations */
+};
+
+
+static double bench_now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static int cmp_u32(const void *a, const void *b){
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+/* fill in round trips and latency percentiles from the simulator's stats
+ * since 'first' commands and 'xfers' transfers
+ */
+static void bench_latency(struct bench_result *r, struct nrf_sim_stats *st,
+        unsigned long first, unsigned long xfers){
+    unsigned long n = st->nlatency - first, i;
+    uint32_t *lat;
+
+    r->round_trips = n / r->iterations;
+    r->transfers = (st->transfers - xfers) / r->iterations;
+    if(n > SIM_MAX_LATENCIES){
+        first = st->nlatency - SIM_MAX_LATENCIES;
+        n = SIM_MAX_LATENCIES;
+    }
+    if(n == 0 || (lat = malloc(n * sizeof(*lat))) == NULL){
+        return;
+    }
+    for(i = 0; i < n; i++){
+        lat[i] = st->latency[(first + i) % SIM_MAX_LATENCIES];
+    }
+    qsort(lat, n, sizeof(*lat), cmp_u32);
+    r->p50_us = lat[n / 2];
+    r->p99_us = lat[(n * 99) / 100];
+    free(lat);
+}
+
+
+static void bench_print(const struct bench_result *r){
+    printf("{\"op\":\"%s\",\"iterations\":%d,\"seconds\":%.6f", r->op,
+            r->iterations, r->seconds);
+    if(r->blocks){
+        printf(",\"blocks\":%lu,\"blocks_per_s\":%.1f", r->blocks,
+                r->blocks / r->seconds);
+    }
+    if(r->pages){
+        printf(",\"pages\":%lu,\"pages_per_s\":%.1f", r->pages,
+                r->pages / r->seconds);
+    }
+    if(r->bytes){
+        printf(",\"bytes\":%lu,\"mbytes_per_s\":%.2f", r->bytes,
+                r->bytes / r->seconds / 1e6);
+    }
+    if(r->round_trips){
+        printf(",\"round_trips\":%lu,\"transfers\":%lu,\"p50_us\":%u"
+                ",\"p99_us\":%u", r->round_trips, r->transfers, r->p50_us,
+                r->p99_us);
+    }
+    if(r->retries){
+        printf(",\"retries\":%lu", r->retries);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+
+/* write img out as an Intel HEX file, 16 bytes per record */
+static int bench_write_hex(const struct nrf_image *img, const char *fn){
+    FILE *fp;
+    int rc;
+
+    if((fp = fopen(fn, "w")) == NULL){
+        return -1;
+    }
+    rc = Save_IHexImage(fp, img->data, img->mask, FLASH_SIZE, 16);
+    if(fclose(fp)){
+        rc = -1;
+    }
+    return rc;
+}
+
+
+/* pages first..last-1 of random data */
+static void bench_image(struct nrf_image *img, int first, int last,
+        unsigned seed){
+    unsigned addr;
+
+    memset(img->data, 0xFF, sizeof(img->data));
+    memset(img->mask, 0, sizeof(img->mask));
+    for(addr = page2addr(first); addr < page2addr(last); addr++){
+        img->data[addr] = (unsigned char)rand_r(&seed);
+        bitset(img->mask, addr);
+    }
+}
+
+
+static int bench_open(devp dev, const struct nrf_sim_config *cfg){
+    memset(dev, 0, sizeof(*dev));
+    if(nrf_sim_open(dev, cfg)){
+        return -1;
+    }
+    dev->quiet = true;
+    return 0;
+}
+
+
+int main(int argc, char *argv[]){
+    struct nrf_sim_config cfg;
+    struct nrf_dev nrf;
+    devp dev = &nrf;
+    struct nrf_sim_stats *st;
+    struct nrf_image *full = NULL, *partial = NULL, *parsed = NULL;
+    struct bench_result r;
+    const char *spec = DEFAULT_SPEC;
+    char hex_fn[] = "/tmp/nrfbench-XXXXXX", *img_fn = hex_fn;
+    unsigned long first, xfers;
+    int c, i, n = 3, exit_code = 1, fd;
+    double t;
+    FILE *fp;
+
+    while((c = getopt(argc, argv, "hn:s:")) != -1){
+        switch(c){
+        case 'n':
+            n = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        case 's':
+            spec = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: nrfbench [-n iterations] [-s spec]\n");
+            exit(1);
+        }
+    }
+    if(nrf_sim_parse(&cfg, spec)){
+        fprintf(stderr, "[!] Invalid simulator spec: %s\n", spec);
+        exit(1);
+    }
+
+    if((full = malloc(sizeof(*full))) == NULL ||
+            (partial = malloc(sizeof(*partial))) == NULL ||
+            (parsed = malloc(sizeof(*parsed))) == NULL ||
+            (fd = mkstemp(hex_fn)) < 0){
+        fprintf(stderr, "[!] Out of memory or temp files.\n");
+        goto error;
+    }
+    close(fd);
+    /* an application filling everything below the loader, and an update
+     * that changes a few of its pages
+     */
+    bench_image(full, 0, addr2page(BOOTLOADER_VECTOR), 1);
+    bench_image(partial, 0, addr2page(BOOTLOADER_VECTOR), 1);
+    memset(partial->mask, 0, sizeof(partial->mask));
+    for(i = 0; i < 4; i++){
+        bitset(partial->mask, page2addr(10 * i) + 100);
+    }
+
+    printf("{\"spec\":\"%s\"}\n", spec);
+
+    /* dump */
+    memset(&r, 0, sizeof(r));
+    r.op = "dump";
+    r.iterations = n;
+    r.blocks = 512;
+    if(bench_open(dev, &cfg)){
+        goto error;
+    }
+    st = nrf_sim_stats(dev);
+    first = st->nlatency;
+    xfers = st->transfers;
+    t = bench_now();
+    for(i = 0; i < n; i++){
+        if(nrf_dump(dev, "/dev/null", NULL)){
+            fprintf(stderr, "[!] dump failed\n");
+            goto error;
+        }
+    }
+    r.seconds = (bench_now() - t) / n;
+    bench_latency(&r, st, first, xfers);
+    r.retries = dev->retries;
+    nrf_close(dev);
+    bench_print(&r);
+
+    /* full program onto a blank device, so every page is written */
+    memset(&r, 0, sizeof(r));
+    r.op = "program_full";
+    r.iterations = n;
+    r.pages = addr2page(BOOTLOADER_VECTOR);
+    r.blocks = page2block(r.pages);
+    t = 0;
+    for(i = 0; i < n; i++){
+        if(bench_open(dev, &cfg)){
+            goto error;
+        }
+        st = nrf_sim_stats(dev);
+        t -= bench_now();
+        if(nrf_program_image(dev, full)){
+            fprintf(stderr, "[!] full program failed\n");
+            goto error;
+        }
+        t += bench_now();
+        if(i == n - 1){
+            /* the last run stands for all of them */
+            r.iterations = 1;
+            bench_latency(&r, st, 0, 0);
+            r.iterations = n;
+        }
+        r.retries += dev->retries;
+        nrf_close(dev);
+    }
+    r.seconds = t / n;
+    bench_print(&r);
+
+    /* partial program: a few bytes on four pages of a programmed device */
+    memset(&r, 0, sizeof(r));
+    r.op = "program_partial";
+    r.iterations = n;
+    r.pages = 4;
+    r.blocks = 4;
+    if(bench_open(dev, &cfg) || nrf_program_image(dev, full)){
+        goto error;
+    }
+    st = nrf_sim_stats(dev);
+    t = 0;
+    first = st->nlatency;
+    xfers = st->transfers;
+    for(i = 0; i < n; i++){
+        /* flip the bytes every run so they always change */
+        for(c = 0; c < 4; c++){
+            partial->data[page2addr(10 * c) + 100] ^= 0x55;
+        }
+        t -= bench_now();
+        if(nrf_program_image(dev, partial)){
+            fprintf(stderr, "[!] partial program failed\n");
+            goto error;
+        }
+        t += bench_now();
+    }
+    r.seconds = t / n;
+    bench_latency(&r, st, first, xfers);
+    r.retries = dev->retries;
+    nrf_close(dev);
+    bench_print(&r);
+
+    /* ihex parse */
+    memset(&r, 0, sizeof(r));
+    r.op = "ihex_parse";
+    r.iterations = n * 20;
+    if(bench_write_hex(full, hex_fn)){
+        fprintf(stderr, "[!] writing %s failed\n", hex_fn);
+        goto error;
+    }
+    if((fp = fopen(hex_fn, "r"))){
+        fseek(fp, 0, SEEK_END);
+        r.bytes = ftell(fp);
+        fclose(fp);
+    }
+    t = bench_now();
+    for(i = 0; i < r.iterations; i++){
+        if(nrf_load_ihex(parsed, hex_fn, nrf_write_limit())){
+            fprintf(stderr, "[!] parsing %s failed\n", hex_fn);
+            goto error;
+        }
+    }
+    r.seconds = (bench_now() - t) / r.iterations;
+    bench_print(&r);
+    if(memcmp(parsed->data, full->data, FLASH_SIZE)){
+        fprintf(stderr, "[!] parsed image differs\n");
+        goto error;
+    }
+
+    /* compiled image load, the same image without the parse */
+    memset(&r, 0, sizeof(r));
+    r.op = "image_load";
+    r.iterations = n * 20;
+    r.bytes = sizeof(*full);
+    if(nrf_image_save(full, hex_fn)){
+        fprintf(stderr, "[!] writing %s failed\n", hex_fn);
+        goto error;
+    }
+    t = bench_now();
+    for(i = 0; i < r.iterations; i++){
+        if(nrf_load_images(parsed, &img_fn, 1, nrf_write_limit())){
+            fprintf(stderr, "[!] loading %s failed\n", hex_fn);
+            goto error;
+        }
+    }
+    r.seconds = (bench_now() - t) / r.iterations;
+    bench_print(&r);
+    if(memcmp(parsed, full, sizeof(*full))){
+        fprintf(stderr, "[!] loaded image differs\n");
+        goto error;
+    }
+
+    /* ihex emit */
+    memset(&r, 0, sizeof(r));
+    r.op = "ihex_emit";
+    r.iterations = n * 20;
+    t = bench_now();
+    for(i = 0; i < r.iterations; i++){
+        if(bench_write_hex(full, hex_fn)){
+            fprintf(stderr, "[!] writing %s failed\n", hex_fn);
+            goto error;
+        }
+    }
+    r.seconds = (bench_now() - t) / r.iterations;
+    if((fp = fopen(hex_fn, "r"))){
+        fseek(fp, 0, SEEK_END);
+        r.bytes = ftell(fp);
+        fclose(fp);
+    }
+    bench_print(&r);
+
+    exit_code = 0;
+error:
+    remove(hex_fn);
+    free(full);
+    free(partial);
+    free(parsed);
+    return exit_code;
+}
@@ -133,6 +133,252 @@ int Write_IHexRecord(const IHexRecord *ihexRecord, FILE *out) {
 	return IHEX_OK;
 }
 
+/* Lookup table for ASCII hex digits, -1 for anything that is not one */
+static const int8_t hexValue[256] = {
+	['0'] = 0+1, ['1'] = 1+1, ['2'] = 2+1, ['3'] = 3+1, ['4'] = 4+1,
+	['5'] = 5+1, ['6'] = 6+1, ['7'] = 7+1, ['8'] = 8+1, ['9'] = 9+1,
+	['A'] = 10+1, ['B'] = 11+1, ['C'] = 12+1, ['D'] = 13+1, ['E'] = 14+1, ['F'] = 15+1,
+	['a'] = 10+1, ['b'] = 11+1, ['c'] = 12+1, ['d'] = 13+1, ['e'] = 14+1, ['f'] = 15+1,
+};
+
+/* Decodes one ASCII hex byte, returns -1 if either character is not a hex digit.
+ * The table stores digit+1 so the zero fill means "not a digit". */
+static inline int decodeHexByte(const char *p) {
+	int hi = hexValue[(uint8_t)p[0]] - 1, lo = hexValue[(uint8_t)p[1]] - 1;
+
+	if (hi < 0 || lo < 0)
+		return -1;
+	return (hi << 4) | lo;
+}
+
+/* Size of the read buffer of Load_IHexImage(), must hold at least one whole record line */
+#define IHEX_LOAD_BUFF_SIZE 16384
+
+/* Utility function to load a whole Intel HEX8 file into a flat image */
+int Load_IHexImage(FILE *in, uint8_t *image, uint8_t *mask, uint32_t size, uint32_t *badFirst, uint32_t *badLast) {
+	char buff[IHEX_LOAD_BUFF_SIZE];
+	size_t have = 0, pos = 0, n;
+	const char *line, *end;
+	int dataCount, type, byte, i;
+	uint32_t address;
+	uint8_t checksum;
+	int atEOF = 0;
+
+	/* Check our image pointers and file pointer */
+	if (in == NULL || image == NULL || mask == NULL)
+		return IHEX_ERROR_INVALID_ARGUMENTS;
+
+	for (;;) {
+		/* Find the end of the next line, refilling the buffer as needed */
+		end = NULL;
+		while (pos < have && (end = memchr(buff + pos, '\n', have - pos)) == NULL && !atEOF) {
+			/* Slide the partial line to the front and read more */
+			memmove(buff, buff + pos, have - pos);
+			have -= pos;
+			pos = 0;
+			if (have == sizeof(buff))
+				return IHEX_ERROR_INVALID_RECORD;
+			n = fread(buff + have, 1, sizeof(buff) - have, in);
+			if (n == 0) {
+				if (ferror(in))
+					return IHEX_ERROR_FILE;
+				atEOF = 1;
+			}
+			have += n;
+		}
+		if (pos >= have) {
+			if (atEOF)
+				return IHEX_OK;
+			/* The buffer is empty, read more */
+			pos = have = 0;
+			n = fread(buff, 1, sizeof(buff), in);
+			if (n == 0) {
+				if (ferror(in))
+					return IHEX_ERROR_FILE;
+				return IHEX_OK;
+			}
+			have = n;
+			continue;
+		}
+		if (end == NULL)
+			end = buff + have;
+		line = buff + pos;
+		pos = end - buff + 1;
+
+		/* Strip the \r of a \r\n line ending and skip blank lines */
+		if (end > line && end[-1] == '\r')
+			end--;
+		if (end == line)
+			continue;
+
+		/* Check the start code, then size check for count, address, and type fields */
+		if (line[IHEX_START_CODE_OFFSET] != IHEX_START_CODE || end - line < 1+IHEX_COUNT_LEN+IHEX_ADDRESS_LEN+IHEX_TYPE_LEN)
+			return IHEX_ERROR_INVALID_RECORD;
+		if ((dataCount = decodeHexByte(line+IHEX_COUNT_OFFSET)) < 0)
+			return IHEX_ERROR_INVALID_RECORD;
+		/* Size check for start code, count, address, type, data and checksum fields */
+		if (end - line < 1+IHEX_COUNT_LEN+IHEX_ADDRESS_LEN+IHEX_TYPE_LEN+dataCount*2+IHEX_CHECKSUM_LEN)
+			return IHEX_ERROR_INVALID_RECORD;
+
+		/* Decode the address and type, summing every byte for the checksum as we go */
+		checksum = dataCount;
+		address = 0;
+		for (i = 0; i < 2; i++) {
+			if ((byte = decodeHexByte(line+IHEX_ADDRESS_OFFSET+2*i)) < 0)
+				return IHEX_ERROR_INVALID_RECORD;
+			address = (address << 8) | byte;
+			checksum += byte;
+		}
+		if ((type = decodeHexByte(line+IHEX_TYPE_OFFSET)) < 0)
+			return IHEX_ERROR_INVALID_RECORD;
+		checksum += type;
+
+		if (type == IHEX_TYPE_00) {
+			if (dataCount > 0 && address + dataCount > size) {
+				if (badFirst != NULL)
+					*badFirst = address;
+				if (badLast != NULL)
+					*badLast = address + dataCount - 1;
+				return IHEX_ERROR_RANGE;
+			}
+			/* Decode the data straight into the image */
+			for (i = 0; i < dataCount; i++) {
+				if ((byte = decodeHexByte(line+IHEX_DATA_OFFSET+2*i)) < 0)
+					return IHEX_ERROR_INVALID_RECORD;
+				image[address+i] = byte;
+				mask[(address+i)/8] |= 1U << ((address+i)%8);
+				checksum += byte;
+			}
+		} else if (type == IHEX_TYPE_01) {
+			for (i = 0; i < dataCount; i++) {
+				if ((byte = decodeHexByte(line+IHEX_DATA_OFFSET+2*i)) < 0)
+					return IHEX_ERROR_INVALID_RECORD;
+				checksum += byte;
+			}
+		} else {
+			return IHEX_ERROR_UNSUPPORTED;
+		}
+
+		/* The checksum field brings the sum of all bytes to zero */
+		if ((byte = decodeHexByte(line+IHEX_DATA_OFFSET+dataCount*2)) < 0)
+			return IHEX_ERROR_INVALID_RECORD;
+		if ((uint8_t)(checksum + byte) != 0)
+			return IHEX_ERROR_INVALID_RECORD;
+
+		if (type == IHEX_TYPE_01)
+			return IHEX_OK;
+	}
+}
+
+/* Lookup table for encoding a nibble as an ASCII hex digit */
+static const char hexDigit[16] = "0123456789ABCDEF";
+
+/* Size of the write buffer of Save_IHexImage(), flushed with one fwrite() when it fills */
+#define IHEX_SAVE_BUFF_SIZE 16384
+
+/* Worst case length of one formatted record: start code, count, address, type, 255 data bytes, checksum and \r\n */
+#define IHEX_SAVE_RECORD_LEN (1+IHEX_COUNT_LEN+IHEX_ADDRESS_LEN+IHEX_TYPE_LEN+255*2+IHEX_CHECKSUM_LEN+2)
+
+/* Length of the formatted end-of-file record, which carries no data */
+#define IHEX_SAVE_EOF_LEN (1+IHEX_COUNT_LEN+IHEX_ADDRESS_LEN+IHEX_TYPE_LEN+IHEX_CHECKSUM_LEN+2)
+
+/* Runs of data separated by fewer 0xFF bytes than this are merged, since a new record header costs about as much */
+#define IHEX_SAVE_MERGE_GAP 6
+
+/* Encodes one byte as two ASCII hex digits */
+static inline char *encodeHexByte(char *p, uint8_t byte) {
+	p[0] = hexDigit[byte >> 4];
+	p[1] = hexDigit[byte & 0xF];
+	return p + 2;
+}
+
+/* Formats one record into p, returns the end of the record */
+static char *encodeIHexRecord(char *p, int type, uint16_t address, const uint8_t *data, int dataLen) {
+	uint8_t checksum;
+	int i;
+
+	*p++ = IHEX_START_CODE;
+	p = encodeHexByte(p, dataLen);
+	p = encodeHexByte(p, address >> 8);
+	p = encodeHexByte(p, address & 0xFF);
+	p = encodeHexByte(p, type);
+	checksum = dataLen + (address >> 8) + (address & 0xFF) + type;
+	for (i = 0; i < dataLen; i++) {
+		p = encodeHexByte(p, data[i]);
+		checksum += data[i];
+	}
+	p = encodeHexByte(p, ~checksum + 1);
+	*p++ = '\r';
+	*p++ = '\n';
+	return p;
+}
+
+/* Returns non-zero if the image byte at address should be written */
+static inline int selectedByte(const uint8_t *image, const uint8_t *mask, uint32_t address) {
+	if (mask != NULL)
+		return mask[address/8] & (1U << (address%8));
+	return image[address] != 0xFF;
+}
+
+/* Utility function to write a flat image as an Intel HEX8 file */
+int Save_IHexImage(FILE *out, const uint8_t *image, const uint8_t *mask, uint32_t size, int recordLength) {
+	char buff[IHEX_SAVE_BUFF_SIZE];
+	char *p = buff;
+	uint32_t address, runEnd, gapEnd, recordEnd;
+
+	/* Check our image pointers, file pointer, record length and image size */
+	if (out == NULL || image == NULL || recordLength < 1 || recordLength > 255 || size > 0x10000)
+		return IHEX_ERROR_INVALID_ARGUMENTS;
+
+	address = 0;
+	while (address < size) {
+		/* Skip to the start of the next run */
+		if (!selectedByte(image, mask, address)) {
+			address++;
+			continue;
+		}
+		/* Find the end of the run, absorbing short gaps of unselected bytes */
+		runEnd = address + 1;
+		for (;;) {
+			while (runEnd < size && selectedByte(image, mask, runEnd))
+				runEnd++;
+			if (mask != NULL)
+				break;
+			for (gapEnd = runEnd; gapEnd < size && gapEnd - runEnd < IHEX_SAVE_MERGE_GAP && !selectedByte(image, mask, gapEnd); gapEnd++)
+				;
+			if (gapEnd == size || gapEnd - runEnd >= IHEX_SAVE_MERGE_GAP)
+				break;
+			runEnd = gapEnd;
+		}
+
+		/* Emit the run as records that end on recordLength boundaries */
+		while (address < runEnd) {
+			recordEnd = (address / recordLength + 1) * recordLength;
+			if (recordEnd > runEnd)
+				recordEnd = runEnd;
+			if (p - buff > (int)sizeof(buff) - IHEX_SAVE_RECORD_LEN) {
+				if (fwrite(buff, 1, p - buff, out) != (size_t)(p - buff))
+					return IHEX_ERROR_FILE;
+				p = buff;
+			}
+			p = encodeIHexRecord(p, IHEX_TYPE_00, address, &image[address], recordEnd - address);
+			address = recordEnd;
+		}
+	}
+
+	/* Write the end-of-file record and flush, the last data record may have left no room for it */
+	if (p - buff > (int)sizeof(buff) - IHEX_SAVE_EOF_LEN) {
+		if (fwrite(buff, 1, p - buff, out) != (size_t)(p - buff))
+			return IHEX_ERROR_FILE;
+		p = buff;
+	}
+	p = encodeIHexRecord(p, IHEX_TYPE_01, 0, NULL, 0);
+	if (fwrite(buff, 1, p - buff, out) != (size_t)(p - buff))
+		return IHEX_ERROR_FILE;
+
+	return IHEX_OK;
+}
+
 /* Utility function to print the information stored in an Intel HEX8 record */
 void Print_IHexRecord(const IHexRecord *ihexRecord) {
 	int i;
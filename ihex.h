@@ -44,6 +44,8 @@ enum IHexErrors {
 	IHEX_ERROR_INVALID_RECORD = -3, 	/**< Error code for error if an invalid record was read. */
 	IHEX_ERROR_INVALID_ARGUMENTS = -4, 	/**< Error code for error from invalid arguments passed to function. */
 	IHEX_ERROR_NEWLINE = -5, 		/**< Error code for encountering a newline with no record when reading from a file. */
+	IHEX_ERROR_UNSUPPORTED = -6, 		/**< Error code for a record type that a flat image cannot represent (types 02 through 05). */
+	IHEX_ERROR_RANGE = -7, 			/**< Error code for a data record that reaches past the end of the image. */
 };
 
 /**
@@ -107,6 +109,44 @@ int Read_IHexRecord(IHexRecord *ihexRecord, FILE *in);
 */
 int Write_IHexRecord(const IHexRecord *ihexRecord, FILE *out);
 
+/**
+ * Loads a whole Intel HEX8 file straight into a flat memory image.
+ * The file is read through a fixed buffer in one forward pass, so pipes work. Hex digits are decoded with a lookup table,
+ * checksums are checked as each record is decoded, and data lands directly in the image without an IHexRecord copy.
+ * Loading stops at the end-of-file record or at the end of the file. Blank lines are skipped.
+ * \param in A file pointer to an opened file that can be read.
+ * \param image The image, indexed by record address. Bytes no record touches are left alone.
+ * \param mask A bit vector with one bit per image byte (bit n is mask[n/8] & (1 << n%8)). The bit of every byte written is set.
+ * \param size The size of the image. Data records must end below this address.
+ * \param badFirst If not NULL, receives the first address of the record that failed with IHEX_ERROR_RANGE.
+ * \param badLast If not NULL, receives the last address of the record that failed with IHEX_ERROR_RANGE.
+ * \return IHEX_OK on success, otherwise one of the IHEX_ERROR_ error codes.
+ * \retval IHEX_OK on success.
+ * \retval IHEX_ERROR_INVALID_ARGUMENTS if a pointer is NULL.
+ * \retval IHEX_ERROR_FILE if a file reading error has occured.
+ * \retval IHEX_ERROR_INVALID_RECORD if a record is malformed or its checksum is invalid.
+ * \retval IHEX_ERROR_UNSUPPORTED if the file has segment or linear address records.
+ * \retval IHEX_ERROR_RANGE if a data record reaches past size.
+*/
+int Load_IHexImage(FILE *in, uint8_t *image, uint8_t *mask, uint32_t size, uint32_t *badFirst, uint32_t *badLast);
+
+/**
+ * Writes a flat memory image as an Intel HEX8 file, followed by an end-of-file record.
+ * Records are formatted with a lookup table into an output buffer that is written with one fwrite() each time it fills.
+ * Adjacent runs of data are merged into records of up to recordLength bytes, split on recordLength address boundaries.
+ * \param out A file pointer to an opened file that can be written to.
+ * \param image The image to write.
+ * \param mask If not NULL, a bit vector laid out as in Load_IHexImage() that selects the bytes to write.
+ * If NULL, every byte that is not 0xFF is written, and runs separated by a few 0xFF bytes are merged.
+ * \param size The size of the image.
+ * \param recordLength The largest number of data bytes in a record, 1 to 255.
+ * \return IHEX_OK on success, otherwise one of the IHEX_ERROR_ error codes.
+ * \retval IHEX_OK on success.
+ * \retval IHEX_ERROR_INVALID_ARGUMENTS if a pointer is NULL, recordLength is out of range or the image does not fit 16-bit addresses.
+ * \retval IHEX_ERROR_FILE if a file writing error has occured.
+*/
+int Save_IHexImage(FILE *out, const uint8_t *image, const uint8_t *mask, uint32_t size, int recordLength);
+
 /**
  * Prints the contents of an Intel HEX8 record structure to stdout.
  * The record dump consists of the type, address, entire data array, and checksum fields of the record.
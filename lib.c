@@ -0,0 +1,605 @@
+/* lib.c: nRF24LU1+ loader operations for event loops
+ *
+ * Copyright (C) 2012 Tristan Willy <tristan.willy at gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libusb.h>
+#include "nrf.h"
+#include "sim.h"
+#include "libnrfdude.h"
+
+
+/* operations
+ *
+ * An operation is the same command stream nrf_read_bv(), nrf_verify_image()
+ * and nrf_program_image() produce, cut into steps. Each step queues one
+ * command, and steps are only taken while the next queue slot is free, so
+ * nrf_queue_cmd() never has to wait. Completions free slots, and the next
+ * nrf_lib_dispatch() fills them again.
+ *
+ * Where the blocking code drains the queue before an address MSB change, an
+ * operation queues the 0x06 in line: the loader handles commands in order,
+ * so every 0x03 behind it reads the new half. The MSB the loader will have
+ * once everything queued has run is tracked in 'msb'.
+ *
+ * The journal, the image cache and retries stay with the blocking code. A
+ * failed operation reports its error and the host decides whether to run it
+ * again. The next operation on the device resyncs the loader first, which
+ * blocks, see libnrfdude.h.
+ */
+enum nrf_op_kind {
+    OP_READ,
+    OP_VERIFY,
+    OP_PROGRAM,
+};
+
+enum nrf_op_state {
+    ST_READ,                /* reading the blocks in want_bv */
+    ST_WRITE,               /* writing and verifying dirty pages */
+};
+
+struct nrf_op {
+    devp dev;
+    enum nrf_op_kind kind;
+    enum nrf_op_state state;
+    struct nrf_queue q;
+    const struct nrf_image *img;
+    unsigned char *flash;   /* read target, the caller's for OP_READ */
+    unsigned char *check;   /* verify reads of OP_PROGRAM */
+    unsigned char want_bv[64], got_bv[64], dirty_bv[64], full_bv[8];
+    int block;              /* next block to read */
+    int page, step;         /* next page to write and the step within it */
+    int msb;                /* loader MSB once everything queued has run */
+    int failed;
+    struct nrf_check got[512], status[64][9], verify[512];
+    nrf_op_done_fn done;
+    void *arg;
+};
+
+/* 'dev' comes first so a devp handed out is also the nrf_lib_dev */
+struct nrf_lib_dev {
+    struct nrf_dev dev;
+    struct nrf_lib *lib;
+    struct nrf_op *op;      /* running operation, NULL when idle */
+    struct nrf_lib_dev *next;
+};
+
+struct nrf_lib {
+    libusb_context *usb;
+    struct nrf_lib_dev *devs;
+    bool started;           /* an operation started since the last pump */
+};
+
+
+static int op_msb_cb(void *arg, unsigned char *ret, int retlen){
+    if(retlen != 1 || ret[0]){
+        return -2;
+    }
+    return 0;
+}
+
+
+/* queue a 0x06 if block lies in the other half, returns 1 if one went out */
+static int op_msb(struct nrf_op *op, int block){
+    unsigned char cmd[2];
+
+    if(op->msb == block / 0x100){
+        return 0;
+    }
+    cmd[0] = 0x06;
+    cmd[1] = (unsigned char)(block / 0x100);
+    if(nrf_queue_cmd(&op->q, cmd, 2, NULL, 1, op_msb_cb, NULL) == 0){
+        op->msb = block / 0x100;
+    }
+    return 1;
+}
+
+
+/* take one step of ST_READ, returns 1 once there is nothing left to queue */
+static int op_read_step(struct nrf_op *op){
+    unsigned char cmd[2];
+    int block;
+
+    while(op->block < 512 && (!bitisset(op->want_bv, op->block) ||
+                bitisset(op->got_bv, op->block))){
+        op->block++;
+    }
+    if((block = op->block) == 512){
+        return 1;
+    }
+    if(op_msb(op, block)){
+        return 0;
+    }
+    op->got[block].block = block;
+    op->got[block].confirmed = op->got_bv;
+    if(op->kind == OP_VERIFY){
+        op->got[block].expect = &op->img->data[block2addr(block)];
+        op->got[block].mask = &op->img->mask[block2addr(block) / 8];
+    } else {
+        op->got[block].expect = NULL;
+        op->got[block].mask = NULL;
+    }
+    cmd[0] = 0x03;
+    cmd[1] = (unsigned char)block;
+    nrf_queue_cmd(&op->q, cmd, 2, &op->flash[block2addr(block)], 64,
+            nrf_got_cb, &op->got[block]);
+    op->block++;
+    return 0;
+}
+
+
+/* take one step of ST_WRITE, returns 1 once there is nothing left to queue
+ *
+ * Steps 0-8 of a page are the flash-write command and its eight data blocks,
+ * 9-16 the verify reads of its dirty blocks, like nrf_queue_page() followed
+ * by the reads nrf_program_image() queues behind it.
+ */
+static int op_write_step(struct nrf_op *op){
+    struct nrf_check *c;
+    unsigned char cmd[2];
+    int block;
+
+    for(; op->page < 64; op->page++, op->step = 0){
+        if(!op->dirty_bv[op->page]){
+            continue;
+        }
+        if(op->step <= 8){
+            c = &op->status[op->page][op->step];
+            c->block = page2block(op->page) + (op->step ? op->step - 1 : 0);
+            c->expect = NULL;
+            c->failed = &op->failed;
+            c->confirmed = NULL;
+            if(op->step == 0){
+                cmd[0] = 0x02;
+                cmd[1] = (unsigned char)op->page;
+                nrf_queue_cmd(&op->q, cmd, 2, NULL, 1, nrf_check_cb, c);
+            } else {
+                nrf_queue_cmd(&op->q, &op->flash[block2addr(c->block)], 64,
+                        NULL, 1, nrf_check_cb, c);
+            }
+            op->step++;
+            return 0;
+        }
+        for(; op->step <= 16; op->step++){
+            block = page2block(op->page) + op->step - 9;
+            if(!bitisset(op->dirty_bv, block)){
+                continue;
+            }
+            if(op_msb(op, block)){
+                return 0;
+            }
+            c = &op->verify[block];
+            c->block = block;
+            c->expect = &op->flash[block2addr(block)];
+            c->failed = &op->failed;
+            c->confirmed = NULL;
+            cmd[0] = 0x03;
+            cmd[1] = (unsigned char)block;
+            nrf_queue_cmd(&op->q, cmd, 2, &op->check[block2addr(block)], 64,
+                    nrf_check_cb, c);
+            op->step++;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/* ST_READ is over for OP_PROGRAM, work out what to write */
+static void op_plan_writes(struct nrf_op *op){
+    int page;
+
+    nrf_image_diff(op->img, op->flash, op->dirty_bv);
+    nrf_image_apply(op->img, op->flash);
+    for(page = 0; page < 64; page++){
+        if(bitisset(op->full_bv, page)){
+            op->dirty_bv[page] = 0xFF;
+        }
+    }
+    op->state = ST_WRITE;
+    op->page = op->step = 0;
+}
+
+
+static void op_free(struct nrf_op *op){
+    if(op->kind != OP_READ && op->flash){
+        free(op->flash);
+    }
+    if(op->check){
+        free(op->check);
+    }
+    free(op);
+}
+
+
+/* end the operation and tell the host */
+static void op_finish(struct nrf_op *op, int rc){
+    struct nrf_lib_dev *ld = (struct nrf_lib_dev *)op->dev;
+
+    if(rc == -1 || rc == -2){
+        rc = (op->state == ST_WRITE) ? -7 : -2;
+    }
+    /* a failed 0x06 leaves the loader's MSB in doubt */
+    op->dev->msb = rc ? -1 : op->msb;
+    nrf_queue_free(&op->q);
+    ld->op = NULL;
+    op->done(op->dev, rc, op->arg);
+    op_free(op);
+}
+
+
+/* keep the queue full, and move on once a state has nothing left */
+static void op_pump(struct nrf_op *op){
+    int rc;
+
+    for(;;){
+        rc = 0;
+        while(!op->q.error && op->q.slot[op->q.next].idle && rc == 0){
+            rc = (op->state == ST_READ) ? op_read_step(op) :
+                op_write_step(op);
+        }
+        if(!op->q.idle){
+            return;
+        } else if(op->q.error){
+            op_finish(op, op->q.error);
+            return;
+        } else if(op->state == ST_READ && op->kind == OP_PROGRAM){
+            op_plan_writes(op);
+        } else {
+            op_finish(op, 0);
+            return;
+        }
+    }
+}
+
+
+static struct nrf_op *op_new(devp dev, enum nrf_op_kind kind,
+        const struct nrf_image *img, unsigned char *flash,
+        nrf_op_done_fn done, void *arg){
+    struct nrf_lib_dev *ld = (struct nrf_lib_dev *)dev;
+    struct nrf_op *op;
+
+    if(ld->op || (op = calloc(1, sizeof(*op))) == NULL){
+        return NULL;
+    }
+    op->dev = dev;
+    op->kind = kind;
+    op->state = ST_READ;
+    op->img = img;
+    op->flash = flash;
+    op->failed = -1;
+    op->done = done;
+    op->arg = arg;
+    if(kind != OP_READ && (op->flash = malloc(FLASH_SIZE)) == NULL){
+        free(op);
+        return NULL;
+    }
+    if(kind == OP_PROGRAM && (op->check = malloc(FLASH_SIZE)) == NULL){
+        op_free(op);
+        return NULL;
+    }
+    if(kind != OP_READ){
+        memset(op->flash, 0xFF, FLASH_SIZE);
+    }
+    /* resyncs a loader the last operation left talking, the one place an
+     * operation blocks
+     */
+    if(nrf_queue_init(&op->q, dev)){
+        nrf_queue_free(&op->q);
+        op_free(op);
+        return NULL;
+    }
+    op->msb = dev->msb;
+    return op;
+}
+
+
+static void op_start(struct nrf_op *op){
+    struct nrf_lib_dev *ld = (struct nrf_lib_dev *)op->dev;
+
+    ld->op = op;
+    ld->lib->started = true;
+}
+
+
+/* start reading all of flash into 'flash', which must stay valid until done
+ * is called
+ */
+int nrf_op_read(devp dev, unsigned char *flash, nrf_op_done_fn done,
+        void *arg){
+    struct nrf_op *op;
+
+    if((op = op_new(dev, OP_READ, NULL, flash, done, arg)) == NULL){
+        return -4;
+    }
+    memset(op->want_bv, 0xFF, sizeof(op->want_bv));
+    op_start(op);
+    return 0;
+}
+
+
+/* start comparing every byte img defines with the device, -8 if one differs
+ *
+ * 'img' must stay valid until done is called.
+ */
+int nrf_op_verify(devp dev, const struct nrf_image *img, nrf_op_done_fn done,
+        void *arg){
+    struct nrf_op *op;
+    int block;
+
+    if((op = op_new(dev, OP_VERIFY, img, NULL, done, arg)) == NULL){
+        return -4;
+    }
+    for(block = 0; block < 512; block++){
+        if(memnotchr(&img->mask[block2addr(block) / 8], 0x00, 8)){
+            bitset(op->want_bv, block);
+        }
+    }
+    op_start(op);
+    return 0;
+}
+
+
+/* start writing img to the device, read-modify-write like
+ * nrf_program_image()
+ *
+ * 'img' must stay valid until done is called. -6 if it touches protected
+ * flash.
+ */
+int nrf_op_program(devp dev, const struct nrf_image *img, nrf_op_done_fn done,
+        void *arg){
+    struct nrf_op *op;
+    int page;
+
+    for(page = 0; page < 64; page++){
+        if(nrf_image_touches(img, page) && !addr_valid(page2addr(page))){
+            return -6;
+        }
+    }
+    if((op = op_new(dev, OP_PROGRAM, img, NULL, done, arg)) == NULL){
+        return -4;
+    }
+    for(page = 0; page < 64; page++){
+        if(nrf_image_covers(img, page)){
+            bitset(op->full_bv, page);
+        } else if(nrf_image_touches(img, page)){
+            op->want_bv[page] = 0xFF;
+        }
+    }
+    op_start(op);
+    return 0;
+}
+
+
+/* context */
+struct nrf_lib *nrf_lib_new(void){
+    struct nrf_lib *lib;
+
+    if((lib = calloc(1, sizeof(*lib))) == NULL){
+        return NULL;
+    }
+    if(libusb_init(&lib->usb)){
+        free(lib);
+        return NULL;
+    }
+    libusb_set_debug(lib->usb, 0);
+    return lib;
+}
+
+
+/* close every device and release the context
+ *
+ * Operations still running are cancelled and their done callbacks are not
+ * called.
+ */
+void nrf_lib_free(struct nrf_lib *lib){
+    while(lib->devs){
+        nrf_lib_close(lib, &lib->devs->dev);
+    }
+    libusb_exit(lib->usb);
+    free(lib);
+}
+
+
+static struct nrf_lib_dev *lib_dev_new(struct nrf_lib *lib){
+    struct nrf_lib_dev *ld;
+
+    if((ld = calloc(1, sizeof(*ld))) == NULL){
+        return NULL;
+    }
+    ld->lib = lib;
+    ld->dev.quiet = true;
+    return ld;
+}
+
+
+static void lib_dev_add(struct nrf_lib *lib, struct nrf_lib_dev *ld,
+        devp *devp_out){
+    ld->next = lib->devs;
+    lib->devs = ld;
+    *devp_out = &ld->dev;
+}
+
+
+/* open the loader at bus-port path, or the first one if path is NULL
+ *
+ * This resets the device and asks for its version, and blocks while doing
+ * so.
+ */
+int nrf_lib_open(struct nrf_lib *lib, const char *path, devp *devp_out){
+    struct nrf_lib_dev *ld;
+    libusb_device **list;
+    char p[32];
+    ssize_t n, i;
+
+    if((ld = lib_dev_new(lib)) == NULL){
+        return -4;
+    }
+    if((n = libusb_get_device_list(lib->usb, &list)) < 0){
+        free(ld);
+        return -1;
+    }
+    for(i = 0; i < n; i++){
+        nrf_usb_path(list[i], p, sizeof(p));
+        if(nrf_usb_match(list[i]) && (path == NULL || strcmp(p, path) == 0)){
+            if(libusb_open(list[i], &ld->dev.handle)){
+                ld->dev.handle = NULL;
+            }
+            break;
+        }
+    }
+    libusb_free_device_list(list, 1);
+
+    /* the context is shared, usb_close() must not exit it */
+    ld->dev.tp = &nrf_usb_transport;
+    ld->dev.usb = lib->usb;
+    if(ld->dev.handle == NULL || nrf_setup(&ld->dev)){
+        ld->dev.usb = NULL;
+        nrf_close(&ld->dev);
+        free(ld);
+        return -1;
+    }
+    nrf_version_str(&ld->dev);
+    lib_dev_add(lib, ld, devp_out);
+    return 0;
+}
+
+
+/* open a simulated loader, see nrf_sim_parse() for the spec */
+int nrf_lib_open_sim(struct nrf_lib *lib, const char *spec, devp *devp_out){
+    struct nrf_sim_config cfg;
+    struct nrf_lib_dev *ld;
+
+    if(nrf_sim_parse(&cfg, spec)){
+        return -1;
+    }
+    if((ld = lib_dev_new(lib)) == NULL){
+        return -4;
+    }
+    if(nrf_sim_open(&ld->dev, &cfg)){
+        free(ld);
+        return -1;
+    }
+    lib_dev_add(lib, ld, devp_out);
+    return 0;
+}
+
+
+/* cancel what dev is doing and close it
+ *
+ * Not to be called from a done callback.
+ */
+void nrf_lib_close(struct nrf_lib *lib, devp dev){
+    struct nrf_lib_dev *ld = (struct nrf_lib_dev *)dev, **pp;
+
+    for(pp = &lib->devs; *pp && *pp != ld; pp = &(*pp)->next);
+    if(*pp == NULL){
+        return;
+    }
+    *pp = ld->next;
+    if(ld->op){
+        nrf_queue_abort(&ld->op->q, -1);
+        nrf_queue_free(&ld->op->q);
+        op_free(ld->op);
+    }
+    dev->usb = NULL;
+    nrf_close(dev);
+    free(ld);
+}
+
+
+/* the libusb context of all USB devices */
+libusb_context *nrf_lib_usb(struct nrf_lib *lib){
+    return lib->usb;
+}
+
+
+/* the fds to wait on for USB devices, free with libusb_free_pollfds()
+ *
+ * libusb_set_pollfd_notifiers() on nrf_lib_usb() tracks them as they change.
+ */
+const struct libusb_pollfd **nrf_lib_pollfds(struct nrf_lib *lib){
+    return libusb_get_pollfds(lib->usb);
+}
+
+
+/* transfers completed on all devices so far */
+static unsigned long lib_completed(struct nrf_lib *lib){
+    struct nrf_lib_dev *ld;
+    unsigned long n = 0;
+
+    for(ld = lib->devs; ld; ld = ld->next){
+        n += ld->dev.completed;
+    }
+    return n;
+}
+
+
+/* run every operation as far as it goes without blocking
+ *
+ * Returns the ms until this is due again even if no poll fd becomes ready,
+ * or -1 if only a poll fd or a new operation can make progress.
+ */
+int nrf_lib_dispatch(struct nrf_lib *lib){
+    struct nrf_lib_dev *ld;
+    unsigned long before;
+    int timeout, t, rc, n;
+
+    do {
+        n = 0;
+        timeout = -1;
+        lib->started = false;
+        before = lib_completed(lib);
+        for(ld = lib->devs; ld; ld = ld->next){
+            if(ld->op){
+                op_pump(ld->op);
+            }
+            if(ld->op == NULL){
+                continue;
+            }
+            if((rc = ld->dev.tp->poll(&ld->dev, &t)) < 0){
+                /* nothing in flight can complete any more */
+                nrf_queue_abort(&ld->op->q, -2);
+                op_finish(ld->op, -2);
+                continue;
+            }
+            n += rc;
+            if(t >= 0 && (timeout < 0 || t < timeout)){
+                timeout = t;
+            }
+        }
+        /* a done callback may have started something on a device that was
+         * already passed, and USB devices share one libusb context, so one
+         * device's poll can complete transfers of a device already passed
+         */
+    } while(n || lib->started || lib_completed(lib) != before);
+    return timeout;
+}
+
+
+/* true while any device has an operation running */
+bool nrf_lib_busy(struct nrf_lib *lib){
+    struct nrf_lib_dev *ld;
+
+    for(ld = lib->devs; ld; ld = ld->next){
+        if(ld->op){
+            return true;
+        }
+    }
+    return false;
+}
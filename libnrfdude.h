@@ -0,0 +1,70 @@
+/* libnrfdude.h: nRF24LU1+ loader operations for event loops
+ *
+ * Copyright (C) 2012 Tristan Willy <tristan.willy at gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LIBNRFDUDE_H
+#define LIBNRFDUDE_H
+
+#include <libusb.h>
+#include "nrf.h"
+
+
+/* library context
+ *
+ * One context owns a libusb context and every device opened through it. The
+ * host application drives all of them from one thread:
+ *
+ *  - wait for any of nrf_lib_pollfds() to become ready, or for the number of
+ *    ms the last nrf_lib_dispatch() returned, whichever comes first
+ *  - call nrf_lib_dispatch()
+ *
+ * Operations run one per device, as many devices at once as the host likes.
+ * Each one is a state machine that moves on as its transfers complete, inside
+ * nrf_lib_dispatch(). Nothing in here blocks except opening and closing a
+ * device, and starting an operation on a loader the last one left owing
+ * responses: nrf_op_*() then resync it first, which can take up to TIMEOUT
+ * per response owed.
+ */
+struct nrf_lib;
+
+/* called from nrf_lib_dispatch() once an operation is over
+ *
+ * 'rc' uses the error codes of nrf.c: 0, -2 read failed, -7 write failed,
+ * -8 verify mismatch. The device is free for the next operation as soon as
+ * this is called, and may be given one from within it.
+ */
+typedef void (*nrf_op_done_fn)(devp dev, int rc, void *arg);
+
+
+struct nrf_lib *nrf_lib_new(void);
+void nrf_lib_free(struct nrf_lib *lib);
+int nrf_lib_open(struct nrf_lib *lib, const char *path, devp *devp_out);
+int nrf_lib_open_sim(struct nrf_lib *lib, const char *spec, devp *devp_out);
+void nrf_lib_close(struct nrf_lib *lib, devp dev);
+
+libusb_context *nrf_lib_usb(struct nrf_lib *lib);
+const struct libusb_pollfd **nrf_lib_pollfds(struct nrf_lib *lib);
+int nrf_lib_dispatch(struct nrf_lib *lib);
+bool nrf_lib_busy(struct nrf_lib *lib);
+
+int nrf_op_read(devp dev, unsigned char *flash, nrf_op_done_fn done,
+        void *arg);
+int nrf_op_verify(devp dev, const struct nrf_image *img, nrf_op_done_fn done,
+        void *arg);
+int nrf_op_program(devp dev, const struct nrf_image *img, nrf_op_done_fn done,
+        void *arg);
+
+#endif
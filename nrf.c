@@ -0,0 +1,2232 @@
+/* nrf.c: nRF24LU1+ USB loader protocol
+ *
+ * Copyright (C) 2012 Tristan Willy <tristan.willy at gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ihex.h"
+#include "nrf.h"
+#include "trace.h"
+
+
+bool protect_bootloader = true;
+const char *cache_dir = NULL;
+int hex_record_len = 32;
+const char *journal_fn = NULL;
+unsigned range_lo = 0, range_hi = FLASH_SIZE - 1;
+
+
+/* status output
+ *
+ * In gang mode several devices talk at once, so lines are prefixed with the
+ * device path and progress dots are dropped.
+ */
+void nrf_printf(devp dev, const char *fmt, ...){
+    va_list ap;
+
+    if(dev->quiet){
+        return;
+    }
+    if(dev->name){
+        if(fmt[0] == '\n'){
+            fmt++;
+        }
+        if(fmt[0] == '\0'){
+            return;
+        }
+        fprintf(stderr, "%s: ", dev->name);
+    }
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    if(dev->name && fmt[strlen(fmt) - 1] != '\n'){
+        fprintf(stderr, "\n");
+    }
+}
+
+
+void nrf_tick(devp dev){
+    if(!dev->name && !dev->quiet){
+        fprintf(stderr, ".");
+    }
+}
+
+
+/* address translation functions
+
+ * The nRF24LU1+ has 32KiB of flash memory. It is divided into 64 pages with
+ * each page holding 8 blocks of 64 bytes.
+ *
+ * Address types from least to most granular: page, block, addr
+ *
+ * Translation to a higher granularity address is exact. Translation to a lower
+ * granularity address is inexact. Inexact translations are floor operations,
+ * so addresses are rounded towards zero.
+ */
+unsigned block2addr(unsigned block){
+    return block * 64;
+}
+unsigned addr2block(unsigned addr){
+    return addr / 64;
+}
+unsigned page2block(unsigned page){
+    return page * 8;
+}
+unsigned block2page(unsigned block){
+    return block / 8;
+}
+unsigned page2addr(unsigned page){
+    return block2addr(page2block(page));
+}
+unsigned addr2page(unsigned addr){
+    return block2page(addr2block(addr));
+}
+
+
+/* bit vector manipulation */
+void bitset(void *bv, int bit){
+    unsigned char *bbv = (unsigned char *)bv;
+
+    bbv[bit / 8] |= 1U << (bit % 8);
+}
+
+
+bool bitisset(void *bv, int bit){
+    unsigned char *bbv = (unsigned char *)bv;
+
+    return (bbv[bit / 8] & (1U << (bit % 8)));
+}
+
+
+/* check if an address is valid
+ *
+ * Valid valid conditions:
+ *  1. Within 0x0000 - 0x7FFF
+ *  2. Not protected:
+ *      a. Bootloader @ 0x7800 - 0x7FFF
+ *
+ * Don't be too smart with this. The code only checks the first, last, and any
+ * block-aligned address it tries to write.
+ */
+bool addr_valid(unsigned addr){
+    if((protect_bootloader && addr < BOOTLOADER_VECTOR) ||
+            (!protect_bootloader && addr < 0x8000U)){
+        return true;
+    } else {
+        return false;
+    }
+}
+
+
+/* end of the flash this run may write, the valid addresses are a prefix */
+unsigned nrf_write_limit(void){
+    return addr_valid(BOOTLOADER_VECTOR) ? FLASH_SIZE : BOOTLOADER_VECTOR;
+}
+
+
+static uint64_t nrf_now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* adaptive timeouts
+ *
+ * Each command class keeps a smoothed round trip time and its variation, the
+ * way TCP does, measured from sending a command to receiving its response.
+ * The class is the opcode, or 0x00 for the data blocks of a page write. Both
+ * transfers of a command time out after srtt + 4 * rttvar, clamped to
+ * TIMEOUT_MIN..TIMEOUT, so a lost response costs a fraction of a second
+ * instead of the full TIMEOUT.
+ */
+static int nrf_cmd_class(const void *cmd, int cmdlen){
+    return cmdlen == 64 ? 0x00 : *(const unsigned char *)cmd & 0x07;
+}
+
+
+static int nrf_timeout(devp dev, int cls){
+    const struct nrf_rtt *r = &dev->rtt[cls];
+    unsigned ms;
+
+    if(r->srtt == 0){
+        return TIMEOUT;
+    }
+    ms = (r->srtt + 4 * r->rttvar) / 1000 + 1;
+    if(ms < TIMEOUT_MIN){
+        return TIMEOUT_MIN;
+    }
+    return ms < TIMEOUT ? (int)ms : TIMEOUT;
+}
+
+
+static void nrf_rtt_sample(devp dev, int cls, uint64_t start){
+    struct nrf_rtt *r = &dev->rtt[cls];
+    uint32_t us = (uint32_t)((nrf_now() - start) / 1000) + 1;
+
+    if(r->srtt == 0){
+        r->srtt = us;
+        r->rttvar = us / 2;
+    } else {
+        r->rttvar = (3 * r->rttvar +
+                (r->srtt > us ? r->srtt - us : us - r->srtt)) / 4;
+        r->srtt = (7 * r->srtt + us) / 8;
+    }
+}
+
+
+/* cost model
+ *
+ * A queued stream completes one response after another, so its wall time is
+ * the sum, over its commands, of the time from the later of the command's
+ * submission and the previous response to the command's own response. That
+ * share is kept per command class, smoothed like srtt, and is what
+ * nrf_plan_image() multiplies out. A synchronous command's share is its whole
+ * round trip. Calibration files carry the shares from one run to the next.
+ */
+static void nrf_cost_sample(devp dev, int cls, uint64_t since){
+    uint32_t us = (uint32_t)((nrf_now() - since) / 1000) + 1;
+    uint32_t *c = &dev->cost[cls];
+
+    *c = *c ? (7 * *c + us) / 8 : us;
+}
+
+
+/* loader bookkeeping
+ *
+ * Every command the loader takes owes one response, and a flash-write command
+ * makes it take the next eight OUT transfers as data. Tracking both lets
+ * nrf_resync() put the loader back into a known state after a failure. An IN
+ * transfer that fails for any reason but a timeout or a cancel has used up
+ * its response.
+ */
+static void nrf_account_out(devp dev, const void *cmd){
+    if(dev->wblocks > 0){
+        dev->wblocks--;
+    } else if(*(const unsigned char *)cmd == 0x02){
+        dev->wblocks = 8;
+    }
+    dev->pending++;
+}
+
+
+static void nrf_account_in(devp dev){
+    if(dev->pending > 0){
+        dev->pending--;
+    }
+}
+
+
+/* bulk transfer, 'opcode' is the command it belongs to for tracing */
+static int nrf_bulk(devp dev, unsigned char endpoint, void *data, int length,
+        unsigned char opcode, int timeout){
+    uint64_t start = 0;
+    int rc;
+
+    if(nrf_trace){
+        start = nrf_trace_now();
+    }
+    rc = dev->tp->bulk(dev, endpoint, data, length, timeout);
+    if(nrf_trace){
+        nrf_trace_record(dev, endpoint, opcode, length, rc,
+                rc ? NRF_XFER_ERROR : NRF_XFER_OK, start);
+    }
+    if(rc == 0 && endpoint == OUT){
+        nrf_account_out(dev, data);
+    } else if(endpoint == IN && rc != LIBUSB_ERROR_TIMEOUT){
+        nrf_account_in(dev);
+    }
+    return rc;
+}
+
+
+/* locate the first byte in 's' that does not match 'c' */
+const void *memnotchr(const void *s, int c, size_t n){
+    const unsigned char *s1 = (const unsigned char *)s;
+    const unsigned char *s2 = s1 + n;
+
+    while(s1 != s2 && *s1 == (unsigned char)c){
+        s1++;
+    }
+
+    if(s1 != s2){
+        return (const void *)s1;
+    } else {
+        return NULL;
+    }
+}
+
+
+/* execute one command, once */
+static int nrf_xchg(devp dev, void *cmd, int cmdlen, void *ret, int retlen,
+        int timeout){
+    unsigned char opcode = nrf_cmd_class(cmd, cmdlen);
+    uint64_t start = nrf_now();
+
+    if(nrf_bulk(dev, OUT, cmd, cmdlen, opcode, timeout)){
+        return -1;
+    }
+    if(nrf_bulk(dev, IN, ret, retlen, opcode, timeout)){
+        return -2;
+    }
+    nrf_rtt_sample(dev, opcode, start);
+    nrf_cost_sample(dev, opcode, start);
+    return 0;
+}
+
+
+/* bring the loader back to a known state after a failed transfer
+ *
+ * A page write the loader has started still takes its remaining blocks, so
+ * they are sent as 0xFF, which programs nothing. Every response it still owes
+ * is read and dropped, waiting the full TIMEOUT for a late one, and the
+ * address MSB is sent again in case the failure hid a change.
+ */
+static int nrf_resync(devp dev){
+    unsigned char fill[64], ret[64], cmd[2];
+
+    memset(fill, 0xFF, sizeof(fill));
+    while(dev->wblocks > 0){
+        if(nrf_bulk(dev, OUT, fill, sizeof(fill), 0x00, TIMEOUT)){
+            return -1;
+        }
+    }
+    while(dev->pending > 0){
+        /* a lost response is already accounted for, a timeout means the
+         * rest are gone for good
+         */
+        if(nrf_bulk(dev, IN, ret, sizeof(ret), 0x00, TIMEOUT) ==
+                LIBUSB_ERROR_TIMEOUT){
+            dev->pending = 0;
+        }
+    }
+    if(dev->msb >= 0){
+        cmd[0] = 0x06;
+        cmd[1] = (unsigned char)dev->msb;
+        if(nrf_xchg(dev, cmd, sizeof(cmd), ret, 1, TIMEOUT)){
+            dev->msb = -1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/* back off and resync before retry number 'attempt' (from 0)
+ *
+ * The resync talks to the loader too and can lose a transfer of its own. It
+ * is then tried again after a longer backoff, up to RETRIES times, without
+ * using up the caller's attempts. Returns non-zero if it never succeeded.
+ */
+static int nrf_retry(devp dev, int attempt){
+    int ms, resync;
+
+    for(resync = 0; ; resync++){
+        ms = BACKOFF_MIN << (attempt + resync);
+        dev->retries++;
+        usleep((ms < BACKOFF_MAX ? ms : BACKOFF_MAX) * 1000);
+        if(nrf_resync(dev) == 0){
+            return 0;
+        }
+        if(resync == RETRIES){
+            return -1;
+        }
+    }
+}
+
+
+/* execute one command
+ *
+ * Commands that only read (version, read block, set MSB) are retried after a
+ * failed transfer. Page writes are retried a page at a time by the caller.
+ */
+int nrf_cmd(devp dev, void *cmd, int cmdlen, void *ret, int retlen){
+    unsigned char opcode = *(unsigned char *)cmd;
+    int attempt, rc;
+
+    if(dev->pending || dev->wblocks){
+        nrf_resync(dev);
+    }
+    for(attempt = 0; ; attempt++){
+        rc = nrf_xchg(dev, cmd, cmdlen, ret, retlen,
+                nrf_timeout(dev, nrf_cmd_class(cmd, cmdlen)));
+        if(rc == 0 || attempt == RETRIES ||
+                (opcode != 0x01 && opcode != 0x03 && opcode != 0x06) ||
+                nrf_retry(dev, attempt)){
+            return rc;
+        }
+    }
+}
+
+
+/* asynchronous command queue
+ *
+ * nrf_cmd() pays a full host round trip for every command and again for every
+ * response. The loader handles commands strictly in order and each bulk
+ * endpoint completes transfers in order, so several command/response pairs can
+ * be queued at once and the bus never idles waiting on us. The response to the
+ * n-th queued command always lands in the n-th queued IN transfer.
+ *
+ * An optional callback inspects each response as it arrives. A non-zero return
+ * from it, or any failed transfer, cancels everything still in flight and
+ * becomes the queue's error code.
+ */
+
+
+/* cancel everything in flight, keeping the first error */
+void nrf_queue_abort(struct nrf_queue *q, int error){
+    int i;
+
+    if(q->error){
+        return;
+    }
+    q->error = error;
+    for(i = 0; i < QUEUE_DEPTH; i++){
+        if(q->slot[i].outstanding){
+            /* one of the pair may already be done, which is fine */
+            q->dev->tp->cancel(&q->slot[i].out);
+            q->dev->tp->cancel(&q->slot[i].in);
+        }
+    }
+}
+
+
+/* libusb return code a synchronous transfer would have had, for tracing */
+static int nrf_xfer_rc(enum nrf_xfer_status status){
+    switch(status){
+    case NRF_XFER_OK:
+        return 0;
+    case NRF_XFER_TIMEOUT:
+        return LIBUSB_ERROR_TIMEOUT;
+    case NRF_XFER_CANCELLED:
+        return LIBUSB_ERROR_INTERRUPTED;
+    default:
+        return LIBUSB_ERROR_IO;
+    }
+}
+
+
+static void nrf_queue_cb(struct nrf_xfer *x){
+    struct nrf_slot *s = (struct nrf_slot *)x->user_data;
+    struct nrf_queue *q = s->q;
+    int cls = nrf_cmd_class(s->cmd, s->out.length);
+    int rc;
+
+    q->dev->completed++;
+    if(nrf_trace){
+        nrf_trace_record(q->dev, x->endpoint, cls, x->length,
+                nrf_xfer_rc(x->status), x->status, x->start);
+    }
+    if(x->status == NRF_XFER_OK && x == &s->out){
+        nrf_account_out(q->dev, s->cmd);
+    } else if(x->status == NRF_XFER_OK){
+        nrf_account_in(q->dev);
+        nrf_rtt_sample(q->dev, cls, x->start);
+        nrf_cost_sample(q->dev, cls, x->start > q->last ? x->start : q->last);
+        q->last = nrf_now();
+    } else if(x->status == NRF_XFER_ERROR && x == &s->in){
+        nrf_account_in(q->dev);
+    }
+    if(x->status != NRF_XFER_OK){
+        if(x->status != NRF_XFER_CANCELLED && !q->error){
+            q->lost = s->arg;
+        }
+        nrf_queue_abort(q, x == &s->out ? -1 : -2);
+    } else if(x == &s->in && s->done && !q->error &&
+            (rc = s->done(s->arg, x->buffer, x->actual_length))){
+        nrf_queue_abort(q, rc);
+    }
+
+    if(--s->outstanding == 0){
+        s->idle = 1;
+    }
+    if(--q->outstanding == 0){
+        q->idle = 1;
+    }
+}
+
+
+int nrf_queue_init(struct nrf_queue *q, devp dev){
+    int i;
+
+    /* start from a quiet loader even if the last operation gave up */
+    if(dev->pending || dev->wblocks){
+        nrf_resync(dev);
+    }
+
+    memset(q, 0, sizeof(*q));
+    q->dev = dev;
+    q->idle = 1;
+    for(i = 0; i < QUEUE_DEPTH; i++){
+        q->slot[i].q = q;
+        q->slot[i].idle = 1;
+        q->slot[i].out.dev = q->slot[i].in.dev = dev;
+        if(dev->tp->xfer_init(&q->slot[i].out) ||
+                dev->tp->xfer_init(&q->slot[i].in)){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/* wait for everything in flight, returns the queue's error code */
+int nrf_queue_drain(struct nrf_queue *q){
+    while(!q->idle){
+        if(q->dev->tp->wait(q->dev, &q->idle)){
+            /* nothing left that could ever complete */
+            nrf_queue_abort(q, -2);
+            break;
+        }
+    }
+    return q->error;
+}
+
+
+/* drain and release the queue */
+void nrf_queue_free(struct nrf_queue *q){
+    int i;
+
+    nrf_queue_drain(q);
+    if(q->dev == NULL){
+        return;
+    }
+    for(i = 0; i < QUEUE_DEPTH; i++){
+        /* transports accept transfers that were never set up */
+        q->dev->tp->xfer_free(&q->slot[i].out);
+        q->dev->tp->xfer_free(&q->slot[i].in);
+    }
+}
+
+
+/* queue one command, waiting only if every slot is busy
+ *
+ * 'cmd' is copied and may be reused right away. 'ret' must stay valid until
+ * the queue is drained. If 'ret' is NULL the response goes to a buffer in the
+ * slot, which is only good for the callback to look at.
+ */
+int nrf_queue_cmd(struct nrf_queue *q, const void *cmd, int cmdlen, void *ret,
+        int retlen, nrf_done_fn done, void *arg){
+    struct nrf_slot *s = &q->slot[q->next];
+
+    if(cmdlen < 1 || cmdlen > (int)sizeof(s->cmd) ||
+            (ret == NULL && retlen > (int)sizeof(s->ret))){
+        return -1;
+    }
+
+    /* the oldest slot is reused, so wait for it to come back */
+    while(!s->idle){
+        if(q->dev->tp->wait(q->dev, &s->idle)){
+            nrf_queue_abort(q, -2);
+            break;
+        }
+    }
+    if(q->error){
+        return q->error;
+    }
+
+    memcpy(s->cmd, cmd, cmdlen);
+    s->out.endpoint = OUT;
+    s->out.buffer = s->cmd;
+    s->out.length = cmdlen;
+    s->in.endpoint = IN;
+    s->in.buffer = ret ? (unsigned char *)ret : s->ret;
+    s->in.length = retlen;
+    s->out.callback = s->in.callback = nrf_queue_cb;
+    s->out.user_data = s->in.user_data = s;
+    s->done = done;
+    s->arg = arg;
+    s->out.start = s->in.start = nrf_now();
+    s->out.timeout = s->in.timeout =
+        nrf_timeout(q->dev, nrf_cmd_class(cmd, cmdlen));
+
+    if(q->dev->tp->submit(&s->out)){
+        nrf_queue_abort(q, -1);
+        return q->error;
+    }
+    s->outstanding++;
+    q->outstanding++;
+    s->idle = q->idle = 0;
+    if(q->dev->tp->submit(&s->in)){
+        nrf_queue_abort(q, -2);
+        return q->error;
+    }
+    s->outstanding++;
+    q->outstanding++;
+
+    q->next = (q->next + 1) % QUEUE_DEPTH;
+    return 0;
+}
+
+
+/* set the loader's address MSB (0x06) unless it already has that value */
+int nrf_set_msb(devp dev, int msb){
+    unsigned char cmd[2], ret;
+
+    if(dev->msb == msb){
+        return 0;
+    }
+    cmd[0] = 0x06;
+    cmd[1] = (unsigned char)msb;
+    if(nrf_cmd(dev, cmd, 2, &ret, 1)){
+        dev->msb = -1;
+        return -2;
+    }
+    dev->msb = msb;
+    return 0;
+}
+
+
+/* note a block as its data arrives, and compare the bytes 'mask' selects
+ * with 'expect' if there is one
+ */
+int nrf_got_cb(void *arg, unsigned char *ret, int retlen){
+    struct nrf_check *c = (struct nrf_check *)arg;
+    int i;
+
+    if(retlen != 64){
+        /* short read, as bad as a failed transfer */
+        return -2;
+    }
+    bitset(c->confirmed, c->block);
+    if(c->expect){
+        for(i = 0; i < 64; i++){
+            if(bitisset((void *)c->mask, i) && ret[i] != c->expect[i]){
+                return -8;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/* charge a lost transfer to the one of n blocks or pages it was for
+ *
+ * 'lost' is that one, or -1 if the queue could not tell, in which case
+ * everything sent this pass that is not done yet pays. Returns the most
+ * failures any of them has now seen, or more than RETRIES if there was
+ * nothing to charge.
+ */
+static int nrf_charge(unsigned char *tries, int n, int lost,
+        const void *sent_bv, const void *done_bv){
+    int i, worst = 0;
+
+    for(i = 0; i < n; i++){
+        if(lost >= 0 ? i == lost : bitisset((void *)sent_bv, i) &&
+                !bitisset((void *)done_bv, i)){
+            if(++tries[i] > worst){
+                worst = tries[i];
+            }
+        }
+    }
+    return worst ? worst : RETRIES + 1;
+}
+
+
+/* read every block set in want_bv into its place in flash
+ *
+ * Block reads are queued so the loader always has the next request waiting.
+ * Setting the address MSB (0x06) changes the meaning of every later 0x03, so
+ * it is a barrier: the queue is drained and the MSB is set synchronously. It
+ * is only sent when the loader's current MSB differs from the one needed.
+ *
+ * After a failed transfer the loader is resynced and only the blocks that
+ * have not arrived yet are asked for again. Each block may be lost RETRIES
+ * times before the read gives up.
+ *
+ * If 'img' is given, every block is compared with it as it arrives and the
+ * first one that differs stops the read with -8.
+ */
+static int nrf_read_blocks(devp dev, const void *want_bv, unsigned char *flash,
+        const struct nrf_image *img){
+    struct nrf_queue q;
+    struct nrf_check got[512];
+    unsigned char cmd[2], got_bv[64], sent_bv[64], tries[512];
+    int ecode, block, attempt;
+
+    memset(got_bv, 0, sizeof(got_bv));
+    memset(tries, 0, sizeof(tries));
+    if(nrf_queue_init(&q, dev)){
+        ecode = -4;
+        goto err;
+    }
+    for(;;){
+        memset(sent_bv, 0, sizeof(sent_bv));
+        for(block = 0; block < 0x200 && !q.error; block++){
+            if(!bitisset((void *)want_bv, block) || bitisset(got_bv, block)){
+                continue;
+            }
+            bitset(sent_bv, block);
+            /* set address MSB, only when the read set crosses into the other
+             * half of flash
+             */
+            if(dev->msb != (int)(block / 0x100) &&
+                    (nrf_queue_drain(&q) || nrf_set_msb(dev, block / 0x100))){
+                nrf_queue_abort(&q, -2);
+                break;
+            }
+            /* request the block */
+            got[block].block = block;
+            got[block].confirmed = got_bv;
+            got[block].expect = img ? &img->data[block2addr(block)] : NULL;
+            got[block].mask = img ? &img->mask[block2addr(block) / 8] : NULL;
+            cmd[0] = 0x03;
+            cmd[1] = (unsigned char)block;
+            nrf_queue_cmd(&q, cmd, 2, &flash[block2addr(block)], 64,
+                    nrf_got_cb, &got[block]);
+        }
+        /* only failed transfers are worth another try, and only the block
+         * one was lost for pays for it
+         */
+        ecode = nrf_queue_drain(&q);
+        if(ecode == 0 || (ecode != -1 && ecode != -2)){
+            break;
+        }
+        attempt = nrf_charge(tries, 512,
+                q.lost ? ((struct nrf_check *)q.lost)->block : -1,
+                sent_bv, got_bv);
+        if(attempt > RETRIES || nrf_retry(dev, attempt - 1)){
+            break;
+        }
+        q.error = 0;
+        q.lost = NULL;
+    }
+
+err:
+    nrf_queue_free(&q);
+    return ecode;
+}
+
+
+int nrf_read_bv(devp dev, const void *want_bv, unsigned char *flash){
+    return nrf_read_blocks(dev, want_bv, flash, NULL);
+}
+
+
+int nrf_read_all(devp dev, unsigned char *flash){
+    unsigned char want_bv[64];
+
+    memset(want_bv, 0xFF, sizeof(want_bv));
+    return nrf_read_bv(dev, want_bv, flash);
+}
+
+
+/* flash image cache
+ *
+ * The last known flash contents of each device are kept on disk, keyed by
+ * VID:PID and bus-port path. Another host, a firmware self-update or a board
+ * swap can make an entry stale without us knowing, so a cached image is only
+ * trusted after the pages about to be written and a few sentinel blocks are
+ * read back and found to match. Any failed write drops the entry.
+ *
+ * A device that stays open across jobs can also keep its image in memory
+ * ('mirror'). Nothing else can talk to a loader we hold claimed, so that copy
+ * is used without reading anything back.
+ */
+#define CACHE_MAGIC         "NRFC"
+#define CACHE_VERSION       1
+
+struct nrf_cache_file {
+    char magic[4];
+    uint32_t version;
+    unsigned char data[FLASH_SIZE];
+};
+
+
+/* pick the cache directory: $NRFDUDE_CACHE, $XDG_CACHE_HOME/nrfdude or
+ * $HOME/.cache/nrfdude
+ */
+const char *nrf_cache_default_dir(void){
+    static char dir[PATH_MAX];
+    const char *env;
+
+    if((env = getenv("NRFDUDE_CACHE")) && *env){
+        snprintf(dir, sizeof(dir), "%s", env);
+    } else if((env = getenv("XDG_CACHE_HOME")) && *env){
+        snprintf(dir, sizeof(dir), "%s/nrfdude", env);
+    } else if((env = getenv("HOME")) && *env){
+        snprintf(dir, sizeof(dir), "%s/.cache/nrfdude", env);
+    } else {
+        return NULL;
+    }
+    return dir;
+}
+
+
+static bool nrf_cache_enabled(devp dev){
+    return cache_dir || dev->mirror;
+}
+
+
+static void nrf_cache_fn(devp dev, char *fn, size_t len){
+    snprintf(fn, len, "%s/%04x-%04x-%s.img", cache_dir, VENDOR_NORDIC,
+            PID_NRF24LU, dev->path);
+}
+
+
+/* load the cached image of dev into flash, 0 if there is one */
+int nrf_cache_load(devp dev, unsigned char *flash){
+    struct nrf_cache_file *cf;
+    char fn[PATH_MAX];
+    FILE *fp;
+    int ecode = -1;
+
+    if((cf = malloc(sizeof(*cf))) == NULL){
+        return -4;
+    }
+    nrf_cache_fn(dev, fn, sizeof(fn));
+    if((fp = fopen(fn, "rb"))){
+        if(fread(cf, sizeof(*cf), 1, fp) == 1 &&
+                memcmp(cf->magic, CACHE_MAGIC, 4) == 0 &&
+                cf->version == CACHE_VERSION){
+            memcpy(flash, cf->data, FLASH_SIZE);
+            ecode = 0;
+        }
+        fclose(fp);
+    }
+    free(cf);
+    return ecode;
+}
+
+
+/* remember flash as the current contents of dev */
+int nrf_cache_save(devp dev, const unsigned char *flash){
+    struct nrf_cache_file *cf;
+    char fn[PATH_MAX], tmp[PATH_MAX + 4];
+    FILE *fp = NULL;
+    int ecode;
+
+    if(dev->mirror){
+        memcpy(dev->mirror, flash, FLASH_SIZE);
+        dev->mirror_valid = true;
+    }
+    if(cache_dir == NULL){
+        return 0;
+    }
+
+    if((cf = malloc(sizeof(*cf))) == NULL){
+        ecode = -4;
+        goto err;
+    }
+    memcpy(cf->magic, CACHE_MAGIC, 4);
+    cf->version = CACHE_VERSION;
+    memcpy(cf->data, flash, FLASH_SIZE);
+
+    /* best effort, the parent usually exists already */
+    mkdir(cache_dir, 0755);
+    nrf_cache_fn(dev, fn, sizeof(fn));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", fn);
+    if((fp = fopen(tmp, "wb")) == NULL ||
+            fwrite(cf, sizeof(*cf), 1, fp) != 1){
+        ecode = -1;
+        goto err;
+    }
+    if(fclose(fp) || rename(tmp, fn)){
+        fp = NULL;
+        ecode = -1;
+        goto err;
+    }
+    fp = NULL;
+
+    ecode = 0;
+err:
+    if(fp){
+        fclose(fp);
+        remove(tmp);
+    }
+    if(cf){
+        free(cf);
+    }
+    return ecode;
+}
+
+
+/* forget the contents of dev */
+void nrf_cache_drop(devp dev){
+    char fn[PATH_MAX];
+
+    dev->mirror_valid = false;
+    if(cache_dir){
+        nrf_cache_fn(dev, fn, sizeof(fn));
+        remove(fn);
+    }
+}
+
+
+/* dump all of device flash to fn
+ *
+ * With a reference image only the blocks that differ from it are written, in
+ * full, so laying the dump over the reference gives the device contents
+ * back. Bytes the reference does not define count as blank (0xFF).
+ */
+int nrf_dump(devp dev, const char *fn, const struct nrf_image *ref){
+    unsigned char *flash_copy = NULL, *mask = NULL, want_bv[64], expect;
+    FILE *fp = NULL;
+    int ecode, block, n = 0;
+    unsigned addr;
+    bool all = range_lo == 0 && range_hi == FLASH_SIZE - 1;
+
+    if((fp = strcmp(fn, "-") ? fopen(fn, "w") : stdout) == NULL){
+        ecode = -1;
+        goto err;
+    }
+
+    /* dump */
+    if((flash_copy = malloc(FLASH_SIZE)) == NULL){
+        ecode = -4;
+        goto err;
+    }
+    /* only the blocks covering the range are read, and whatever else they
+     * hold is left out of the file
+     */
+    memset(flash_copy, 0xFF, FLASH_SIZE);
+    memset(want_bv, 0, sizeof(want_bv));
+    for(block = addr2block(range_lo); block <= (int)addr2block(range_hi);
+            block++){
+        bitset(want_bv, block);
+    }
+    if(nrf_read_bv(dev, want_bv, flash_copy)){
+        ecode = -2;
+        goto err;
+    }
+    if(all && nrf_cache_enabled(dev)){
+        nrf_cache_save(dev, flash_copy);
+    }
+    memset(flash_copy, 0xFF, range_lo);
+    memset(&flash_copy[range_hi + 1], 0xFF, FLASH_SIZE - 1 - range_hi);
+    if(ref){
+        if((mask = calloc(FLASH_SIZE / 8, 1)) == NULL){
+            ecode = -4;
+            goto err;
+        }
+        for(block = 0; block < 512; block++){
+            if(!bitisset(want_bv, block)){
+                continue;
+            }
+            for(addr = block2addr(block); addr < block2addr(block + 1);
+                    addr++){
+                expect = bitisset((void *)ref->mask, addr) ?
+                    ref->data[addr] : 0xFF;
+                if(addr >= range_lo && addr <= range_hi &&
+                        flash_copy[addr] != expect){
+                    break;
+                }
+            }
+            if(addr == block2addr(block + 1)){
+                continue;
+            }
+            for(addr = block2addr(block); addr < block2addr(block + 1);
+                    addr++){
+                if(addr >= range_lo && addr <= range_hi){
+                    bitset(mask, addr);
+                }
+            }
+            n++;
+        }
+        nrf_printf(dev, "[*] %d block(s) differ from the reference.\n", n);
+    }
+    /* only bytes that are not 0xFF are written, or with a reference the
+     * blocks that differ
+     */
+    if(Save_IHexImage(fp, flash_copy, mask, FLASH_SIZE, hex_record_len)){
+        ecode = -3;
+        goto err;
+    }
+
+    ecode = 0;
+err:
+    if(flash_copy){
+        free(flash_copy);
+    }
+    if(mask){
+        free(mask);
+    }
+    if(fp && (fp == stdout ? fflush(fp) : fclose(fp)) && ecode == 0){
+        ecode = -3;
+    }
+    return ecode;
+}
+
+
+/* check one queued response
+ *
+ * With 'expect' set the response is a block that must match it, otherwise it
+ * is a status byte that must be zero. The first failure records its block in
+ * 'failed' and fails the queue with -8 or -7 respectively. Once the check
+ * passes the block is marked in 'confirmed', if there is one.
+ */
+int nrf_check_cb(void *arg, unsigned char *ret, int retlen){
+    struct nrf_check *c = (struct nrf_check *)arg;
+
+    if(c->expect && (retlen != 64 || memcmp(ret, c->expect, 64))){
+        *c->failed = c->block;
+        return -8;
+    } else if(!c->expect && (retlen != 1 || ret[0])){
+        *c->failed = c->block;
+        return -7;
+    }
+    if(c->confirmed){
+        bitset(c->confirmed, c->block);
+    }
+    return 0;
+}
+
+
+/* queue a page write
+ *
+ * The flash-write command and all eight blocks go out back to back, and each
+ * status byte is checked as it arrives. A non-zero status cancels the rest of
+ * the page. 'status' needs room for nine checks and must stay valid until the
+ * queue is drained. If 'written' is given the last block of the page is
+ * marked in it once all nine statuses are in.
+ */
+int nrf_queue_page(struct nrf_queue *q, int page, const void *data,
+        struct nrf_check *status, int *failed, unsigned char *written){
+    const unsigned char *b = (const unsigned char *)data;
+    unsigned char cmd[2];
+    int block, ecode;
+
+    if(page < 0 || page > 63){
+        /* invalid page */
+        return -1;
+    }
+
+    /* send the flash-write command */
+    cmd[0] = 0x02;
+    cmd[1] = (unsigned char)page;
+    status[0].block = page2block(page);
+    status[0].expect = NULL;
+    status[0].failed = failed;
+    status[0].confirmed = NULL;
+    if((ecode = nrf_queue_cmd(q, cmd, sizeof(cmd), NULL, 1, nrf_check_cb,
+                    &status[0]))){
+        return ecode;
+    }
+
+    /* send a page of memory, one block at a time */
+    for(block = 0; block < 8; block++){
+        status[block + 1].block = page2block(page) + block;
+        status[block + 1].expect = NULL;
+        status[block + 1].failed = failed;
+        status[block + 1].confirmed = block == 7 ? written : NULL;
+        if((ecode = nrf_queue_cmd(q, &b[block * 64], 64, NULL, 1,
+                        nrf_check_cb, &status[block + 1]))){
+            return ecode;
+        }
+    }
+
+    return 0;
+}
+
+
+/* write one page to flash
+ * returns -1 for an invalid page and -2 if the write failed
+ */
+int nrf_write_page(devp dev, int page, void *data){
+    struct nrf_queue q;
+    struct nrf_check status[9];
+    int ecode, failed = -1;
+
+    if(page < 0 || page > 63){
+        /* invalid page */
+        return -1;
+    }
+
+    if(nrf_queue_init(&q, dev) || nrf_queue_page(&q, page, data, status,
+                &failed, NULL) || nrf_queue_drain(&q)){
+        ecode = -2;
+    } else {
+        ecode = 0;
+    }
+    nrf_queue_free(&q);
+    return ecode;
+}
+
+
+/* compare/verify that a block on the device is identical to the one in data
+ * returns result of memcpy() been device and data
+ */
+int nrf_compare_block(devp dev, int block, void *data){
+    unsigned char cmd[2], devblock[64];
+
+    if(nrf_set_msb(dev, block / 0x100)){
+        return -1;
+    }
+
+    /* request the block */
+    cmd[0] = 0x03;
+    cmd[1] = (unsigned char)block;
+    if(nrf_cmd(dev, cmd, 2, devblock, 64)){
+        return -1;
+    }
+
+    return memcmp(data, devblock, 64);
+}
+
+
+
+/* load an Intel HEX file into img
+ *
+ * Only data records are accepted and every record must land below 'limit',
+ * usually nrf_write_limit().
+ */
+int nrf_load_ihex(struct nrf_image *img, const char *fn, unsigned limit){
+    FILE *fp = NULL;
+    int ecode, rc;
+    uint32_t first_addr, last_addr;
+
+    memset(img->data, 0xFF, sizeof(img->data));
+    memset(img->mask, 0, sizeof(img->mask));
+
+    if((fp = strcmp(fn, "-") ? fopen(fn, "r") : stdin) == NULL){
+        ecode = -1;
+        goto err;
+    }
+    rc = Load_IHexImage(fp, img->data, img->mask, limit, &first_addr,
+            &last_addr);
+    if(rc == IHEX_ERROR_UNSUPPORTED){
+        /* we cannot process segment or linear ihex files */
+        fprintf(stderr,
+                "[!] IHX file contains segment or linear addressing.\n");
+        ecode = -5;
+        goto err;
+    } else if(rc == IHEX_ERROR_RANGE){
+        fprintf(stderr, "[!] IHX record touches invalid or protected bytes: "
+                "0x%04X - 0x%04X\n", first_addr, last_addr);
+        ecode = -6;
+        goto err;
+    } else if(rc != IHEX_OK){
+        ecode = -4;
+        goto err;
+    }
+
+    ecode = 0;
+err:
+    if(fp && fp != stdin){
+        fclose(fp);
+    }
+    return ecode;
+}
+
+
+/* true if img defines any byte of page */
+bool nrf_image_touches(const struct nrf_image *img, int page){
+    return memnotchr(&img->mask[page2addr(page) / 8], 0x00, 64) != NULL;
+}
+
+
+/* true if img defines every byte of page */
+bool nrf_image_covers(const struct nrf_image *img, int page){
+    return memnotchr(&img->mask[page2addr(page) / 8], 0xFF, 64) == NULL;
+}
+
+
+/* mark the blocks of flash_copy that img would change */
+void nrf_image_diff(const struct nrf_image *img,
+        const unsigned char *flash_copy, unsigned char *dirty_bv){
+    unsigned int addr;
+
+    memset(dirty_bv, 0, 64);
+    for(addr = 0; addr < FLASH_SIZE; addr++){
+        if(bitisset((void *)img->mask, addr) &&
+                flash_copy[addr] != img->data[addr]){
+            bitset(dirty_bv, addr2block(addr));
+        }
+    }
+}
+
+
+/* overwrite flash_copy with every byte img defines */
+void nrf_image_apply(const struct nrf_image *img, unsigned char *flash_copy){
+    unsigned int addr;
+
+    for(addr = 0; addr < FLASH_SIZE; addr++){
+        if(bitisset((void *)img->mask, addr)){
+            flash_copy[addr] = img->data[addr];
+        }
+    }
+}
+
+
+#define FNV_OFFSET          0xcbf29ce484222325ULL
+
+static uint64_t nrf_fnv(uint64_t hash, const void *data, size_t len){
+    const unsigned char *p = (const unsigned char *)data;
+    size_t i;
+
+    for(i = 0; i < len; i++){
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+
+/* FNV-1a over the image data and mask */
+uint64_t nrf_image_hash(const struct nrf_image *img){
+    return nrf_fnv(FNV_OFFSET, img, sizeof(*img));
+}
+
+
+/* FNV-1a of all of flash and of each page, and which pages are not blank,
+ * to tell firmware apart without keeping the images around
+ */
+void nrf_fingerprint(const unsigned char *flash, struct nrf_fingerprint *fp){
+    int page;
+
+    fp->hash = nrf_fnv(FNV_OFFSET, flash, FLASH_SIZE);
+    fp->used = 0;
+    for(page = 0; page < FLASH_SIZE / 512; page++){
+        fp->page_hash[page] = nrf_fnv(FNV_OFFSET, &flash[page2addr(page)],
+                page2addr(1));
+        if(memnotchr(&flash[page2addr(page)], 0xFF, page2addr(1))){
+            fp->used |= 1ULL << page;
+        }
+    }
+}
+
+
+/* compiled image files
+ *
+ * A HEX file is parsed on every run. For an image programmed thousands of
+ * times it can be compiled once (-o) into a file that loads with one mmap and
+ * no parsing: a header padded to 4 KiB, then the struct nrf_image as is, so
+ * flash page n starts at data offset page2addr(n) and its mask at
+ * page2addr(n) / 8. The header carries the hash of the whole image, which is
+ * checked on load and is the same hash the journal uses, plus a coverage bit
+ * and a hash of data and mask for every page, for tools that want to compare
+ * images page by page without reading them. Fields are in host byte order.
+ */
+#define IMAGE_MAGIC         "NRFI"
+#define IMAGE_VERSION       1
+#define IMAGE_HEADER        4096
+
+struct nrf_image_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t header_size;   /* offset of the struct nrf_image */
+    uint32_t page_size;
+    uint64_t coverage;      /* bit n set if page n defines any byte */
+    uint64_t hash;          /* nrf_image_hash() */
+    uint64_t page_hash[FLASH_SIZE / 512];
+};
+
+
+/* compile img into the image file fn, "-" for stdout */
+int nrf_image_save(const struct nrf_image *img, const char *fn){
+    struct nrf_image_header *h;
+    char tmp[PATH_MAX + 4];
+    FILE *fp = NULL;
+    int ecode, page;
+
+    if((h = calloc(1, IMAGE_HEADER)) == NULL){
+        ecode = -4;
+        goto err;
+    }
+    memcpy(h->magic, IMAGE_MAGIC, 4);
+    h->version = IMAGE_VERSION;
+    h->header_size = IMAGE_HEADER;
+    h->page_size = page2addr(1);
+    h->hash = nrf_image_hash(img);
+    for(page = 0; page < FLASH_SIZE / 512; page++){
+        if(nrf_image_touches(img, page)){
+            h->coverage |= 1ULL << page;
+        }
+        h->page_hash[page] = nrf_fnv(nrf_fnv(FNV_OFFSET,
+                    &img->data[page2addr(page)], page2addr(1)),
+                &img->mask[page2addr(page) / 8], page2addr(1) / 8);
+    }
+
+    if(strcmp(fn, "-") == 0){
+        /* a pipe, nothing to rename */
+        ecode = 0;
+        if(fwrite(h, IMAGE_HEADER, 1, stdout) != 1 ||
+                fwrite(img, sizeof(*img), 1, stdout) != 1 || fflush(stdout)){
+            ecode = -1;
+        }
+        goto err;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", fn);
+    if((fp = fopen(tmp, "wb")) == NULL ||
+            fwrite(h, IMAGE_HEADER, 1, fp) != 1 ||
+            fwrite(img, sizeof(*img), 1, fp) != 1){
+        ecode = -1;
+        goto err;
+    }
+    if(fclose(fp) || rename(tmp, fn)){
+        fp = NULL;
+        remove(tmp);
+        ecode = -1;
+        goto err;
+    }
+    fp = NULL;
+
+    ecode = 0;
+err:
+    if(fp){
+        fclose(fp);
+        remove(tmp);
+    }
+    if(h){
+        free(h);
+    }
+    return ecode;
+}
+
+
+/* check a loaded image file, 0 if img can be used */
+static int nrf_image_check(const struct nrf_image_header *h,
+        const struct nrf_image *img, const char *fn, unsigned limit){
+    if(h->version != IMAGE_VERSION || h->header_size != IMAGE_HEADER){
+        return -13;
+    }
+    if(nrf_image_hash(img) != h->hash){
+        fprintf(stderr, "[!] %s is damaged.\n", fn);
+        return -13;
+    }
+    /* compiled with -x maybe, but this run may not write the loader */
+    if(memnotchr(&img->mask[limit / 8], 0x00, (FLASH_SIZE - limit) / 8)){
+        fprintf(stderr, "[!] Image touches invalid or protected bytes: "
+                "0x%04X - 0x%04X\n", limit, FLASH_SIZE - 1);
+        return -6;
+    }
+    return 0;
+}
+
+
+/* read an image file from stdin, 1 if the stream holds something else
+ *
+ * A pipe cannot be mapped or rewound, so one byte is peeked: HEX starts with
+ * ':' or blank space, an image file with its magic.
+ */
+static int nrf_image_read(struct nrf_image *img, unsigned limit){
+    struct nrf_image_header *h;
+    int c, ecode;
+
+    if((c = getc(stdin)) == EOF || ungetc(c, stdin) == EOF ||
+            c != IMAGE_MAGIC[0]){
+        return 1;
+    }
+    if((h = malloc(IMAGE_HEADER)) == NULL){
+        return -4;
+    }
+    if(fread(h, IMAGE_HEADER, 1, stdin) != 1 ||
+            memcmp(h->magic, IMAGE_MAGIC, 4) ||
+            fread(img, sizeof(*img), 1, stdin) != 1){
+        ecode = -13;
+    } else {
+        ecode = nrf_image_check(h, img, "-", limit);
+    }
+    free(h);
+    return ecode;
+}
+
+
+/* load the image file fn, "-" for stdin, into img
+ *
+ * Returns 1 if fn is not an image file, so the caller can try it as HEX, and
+ * -13 if it is one that is damaged or from another version. Like HEX files,
+ * the image must not define bytes at or above 'limit'.
+ */
+static int nrf_image_load(struct nrf_image *img, const char *fn,
+        unsigned limit){
+    unsigned char *map = MAP_FAILED;
+    struct stat st;
+    size_t len = IMAGE_HEADER + sizeof(*img);
+    int fd, ecode;
+
+    if(strcmp(fn, "-") == 0){
+        return nrf_image_read(img, limit);
+    }
+    if((fd = open(fn, O_RDONLY)) < 0){
+        return 1;
+    }
+    if(fstat(fd, &st) || (size_t)st.st_size != len ||
+            (map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+            MAP_FAILED || memcmp(map, IMAGE_MAGIC, 4)){
+        ecode = 1;
+        goto err;
+    }
+    memcpy(img, &map[IMAGE_HEADER], sizeof(*img));
+    ecode = nrf_image_check((const struct nrf_image_header *)map, img, fn,
+            limit);
+
+err:
+    if(map != MAP_FAILED){
+        munmap(map, len);
+    }
+    close(fd);
+    return ecode;
+}
+
+
+/* drop every byte of img outside range_lo..range_hi */
+static void nrf_image_clip(struct nrf_image *img){
+    unsigned addr;
+
+    if(range_lo == 0 && range_hi == FLASH_SIZE - 1){
+        return;
+    }
+    for(addr = 0; addr < FLASH_SIZE; addr++){
+        if(addr < range_lo || addr > range_hi){
+            img->mask[addr / 8] &= ~(1U << (addr % 8));
+        }
+    }
+}
+
+
+/* load files that are only compared with a device, never written to it
+ *
+ * Like nrf_load_images(), but the loader region is allowed even without -x,
+ * so a dump of a whole board can serve as a reference.
+ */
+int nrf_load_reference(struct nrf_image *img, char *const *fns, int n){
+    return nrf_load_images(img, fns, n, FLASH_SIZE);
+}
+
+
+/* load several Intel HEX or compiled image files into one image
+ *
+ * Later files are laid over earlier ones. Two files may define the same byte
+ * only if they agree on its value; the first conflict is reported and fails
+ * the load with -11. Bytes outside range_lo..range_hi are dropped, bytes at or
+ * above 'limit' fail it with -6.
+ */
+int nrf_load_images(struct nrf_image *img, char *const *fns, int n,
+        unsigned limit){
+    struct nrf_image *layer = NULL;
+    unsigned char *owner = NULL;
+    unsigned addr, end;
+    int ecode, rc, i;
+
+    if(n < 1 || n > 255){
+        return -1;
+    }
+    if(n == 1){
+        /* nothing to overlay */
+        if((rc = nrf_image_load(img, fns[0], limit)) == 1){
+            rc = nrf_load_ihex(img, fns[0], limit);
+        }
+        if(rc){
+            fprintf(stderr, "[!] Failed to load %s: %d/%s\n", fns[0], rc,
+                    strerror(errno));
+        } else {
+            nrf_image_clip(img);
+        }
+        return rc;
+    }
+    if((layer = malloc(sizeof(*layer))) == NULL ||
+            (owner = calloc(FLASH_SIZE, 1)) == NULL){
+        ecode = -4;
+        goto err;
+    }
+    memset(img->data, 0xFF, sizeof(img->data));
+    memset(img->mask, 0, sizeof(img->mask));
+
+    for(i = 0; i < n; i++){
+        if((rc = nrf_image_load(layer, fns[i], limit)) == 1){
+            rc = nrf_load_ihex(layer, fns[i], limit);
+        }
+        if(rc){
+            fprintf(stderr, "[!] Failed to load %s: %d/%s\n", fns[i], rc,
+                    strerror(errno));
+            ecode = rc;
+            goto err;
+        }
+        for(addr = 0; addr < FLASH_SIZE; addr++){
+            if(!bitisset(layer->mask, addr)){
+                continue;
+            }
+            if(owner[addr] && img->data[addr] != layer->data[addr]){
+                for(end = addr + 1; end < FLASH_SIZE &&
+                        owner[end] == owner[addr] &&
+                        bitisset(layer->mask, end) &&
+                        img->data[end] != layer->data[end]; end++);
+                fprintf(stderr, "[!] %s and %s disagree at 0x%04X - 0x%04X\n",
+                        fns[owner[addr] - 1], fns[i], addr, end - 1);
+                ecode = -11;
+                goto err;
+            }
+            img->data[addr] = layer->data[addr];
+            bitset(img->mask, addr);
+            owner[addr] = i + 1;
+        }
+    }
+    nrf_image_clip(img);
+
+    ecode = 0;
+err:
+    if(layer){
+        free(layer);
+    }
+    if(owner){
+        free(owner);
+    }
+    return ecode;
+}
+
+
+/* programming journal
+ *
+ * A write that dies halfway, say on an unplugged cable or a hub reset, would
+ * otherwise be redone from scratch and erase pages that were already fine.
+ * With a journal each page is appended to it, and fsync()ed, as soon as its
+ * verify read passes. A rerun with the same image on the same port skips
+ * those pages once one block of each reads back as expected, so a swapped
+ * board is never trusted. The journal is removed when the write completes.
+ *
+ * One record per line:
+ *   nrfdude-journal 1 <image hash> <bus-port path>
+ *   page <n>
+ */
+#define JOURNAL_MAGIC       "nrfdude-journal 1"
+
+struct nrf_journal {
+    FILE *fp;
+    char fn[PATH_MAX];
+    char head[96];
+    unsigned char done_bv[8];   /* pages on record */
+};
+
+
+/* write a fresh journal holding the pages in j->done_bv */
+static int nrf_journal_start(struct nrf_journal *j){
+    char tmp[PATH_MAX + 4];
+    int page;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", j->fn);
+    if((j->fp = fopen(tmp, "w")) == NULL){
+        return -1;
+    }
+    fputs(j->head, j->fp);
+    for(page = 0; page < 64; page++){
+        if(bitisset(j->done_bv, page)){
+            fprintf(j->fp, "page %d\n", page);
+        }
+    }
+    /* the stream stays open on the renamed file */
+    if(fflush(j->fp) || fsync(fileno(j->fp)) || rename(tmp, j->fn)){
+        fclose(j->fp);
+        j->fp = NULL;
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* open the journal for img on dev, returns the number of pages it confirms
+ *
+ * Each confirmed page has its first block the image touches read back and
+ * compared. Any difference throws the whole journal away.
+ */
+static int nrf_journal_open(devp dev, const struct nrf_image *img,
+        struct nrf_journal *j){
+    unsigned char want_bv[64], *check = NULL;
+    char line[96];
+    unsigned addr;
+    int ecode, page, block, n = 0;
+    FILE *fp;
+
+    memset(j, 0, sizeof(*j));
+    if(dev->name){
+        snprintf(j->fn, sizeof(j->fn), "%s.%s", journal_fn, dev->name);
+    } else {
+        snprintf(j->fn, sizeof(j->fn), "%s", journal_fn);
+    }
+    snprintf(j->head, sizeof(j->head), JOURNAL_MAGIC " %016llx %s\n",
+            (unsigned long long)nrf_image_hash(img), dev->path);
+    if((fp = fopen(j->fn, "r"))){
+        if(fgets(line, sizeof(line), fp) && strcmp(line, j->head) == 0){
+            while(fgets(line, sizeof(line), fp)){
+                /* a torn last line has no newline */
+                if(sscanf(line, "page %d", &page) == 1 &&
+                        strchr(line, '\n') && page >= 0 && page < 64){
+                    bitset(j->done_bv, page);
+                }
+            }
+        }
+        fclose(fp);
+    }
+
+    memset(want_bv, 0, sizeof(want_bv));
+    for(page = 0; page < 64; page++){
+        if(!bitisset(j->done_bv, page)){
+            continue;
+        }
+        for(block = page2block(page); block < page2block(page + 1) &&
+                !memnotchr(&img->mask[block2addr(block) / 8], 0x00, 8);
+                block++);
+        if(block < page2block(page + 1)){
+            bitset(want_bv, block);
+        }
+        n++;
+    }
+    if(n){
+        if((check = malloc(FLASH_SIZE)) == NULL){
+            ecode = -4;
+            goto err;
+        }
+        if(nrf_read_bv(dev, want_bv, check)){
+            ecode = -2;
+            goto err;
+        }
+        for(addr = 0; addr < FLASH_SIZE; addr++){
+            if(bitisset(want_bv, addr2block(addr)) &&
+                    bitisset((void *)img->mask, addr) &&
+                    check[addr] != img->data[addr]){
+                nrf_printf(dev, "[*] Journal does not match the device.\n");
+                memset(j->done_bv, 0, sizeof(j->done_bv));
+                n = 0;
+                break;
+            }
+        }
+    }
+    if(nrf_journal_start(j)){
+        nrf_printf(dev, "[!] Failed to write journal %s\n", j->fn);
+        ecode = -3;
+        goto err;
+    }
+
+    ecode = n;
+err:
+    if(check){
+        free(check);
+    }
+    return ecode;
+}
+
+
+/* record the pages confirmed since the last call */
+static void nrf_journal_sync(struct nrf_journal *j,
+        const unsigned char *confirmed_bv){
+    bool added = false;
+    int page;
+
+    for(page = 0; page < 64; page++){
+        if(bitisset((void *)confirmed_bv, page) &&
+                !bitisset(j->done_bv, page)){
+            fprintf(j->fp, "page %d\n", page);
+            bitset(j->done_bv, page);
+            added = true;
+        }
+    }
+    if(added){
+        fflush(j->fp);
+        fsync(fileno(j->fp));
+    }
+}
+
+
+/* number of bits set among the first n of bv */
+static int nrf_bv_count(const void *bv, int n){
+    int i, count = 0;
+
+    for(i = 0; i < n; i++){
+        count += bitisset((void *)bv, i);
+    }
+    return count;
+}
+
+
+/* number of address MSB changes reading the blocks set in bv takes, starting
+ * from *msb, which is left at the MSB of the last block
+ */
+static int nrf_bv_msb(const void *bv, int *msb){
+    int block, count = 0;
+
+    for(block = 0; block < 512; block++){
+        if(bitisset((void *)bv, block) && *msb != (int)(block / 0x100)){
+            *msb = block / 0x100;
+            count++;
+        }
+    }
+    return count;
+}
+
+
+/* read back what we are about to erase, and work out what to write
+ *
+ * Why? Because Nordic doesn't have decent software. Their flash write
+ * command erases the page first, instead of letting me decide if the page
+ * should be erased first.
+ *
+ * Byte-level writing is offered by using a read-modify-write operation.
+ * Intel HEX files are not guaranteed to have sequential addressing, so the
+ * whole file is parsed up front and only then do we know which pages it
+ * touches. Only those pages are read. Pages the image covers completely
+ * are not read at all and are always written.
+ *
+ * With the cache enabled the last known contents stand in for the read,
+ * as long as the pages about to be written and a few sentinels still
+ * match them. A missing or stale cache costs one full read so it can be
+ * refilled. An in-memory image is used as is. Pages a journal confirms
+ * are neither read nor written.
+ *
+ * On return flash_copy holds what the device will hold once img is written
+ * and dirty_bv the blocks that change, plus every block of each page the
+ * image covers. Pages in done_bv count as written. 'check' is scratch space
+ * for validating the cache. If 'plan' is given its reads and msb count the
+ * blocks read and the address MSB changes reading them took.
+ */
+static int nrf_prepare(devp dev, const struct nrf_image *img,
+        const unsigned char *done_bv, bool resumed, unsigned char *flash_copy,
+        unsigned char *check, unsigned char *dirty_bv, bool *cached,
+        struct nrf_plan *plan){
+    unsigned char want_bv[64], full_bv[8];
+    int block, page, n = 0, m = 0, msb = dev->msb;
+
+    *cached = false;
+    memset(flash_copy, 0xFF, FLASH_SIZE);
+    memset(full_bv, 0, sizeof(full_bv));
+    if(dev->mirror_valid){
+        memcpy(flash_copy, dev->mirror, FLASH_SIZE);
+        *cached = true;
+    } else if(cache_dir && nrf_cache_load(dev, flash_copy) == 0){
+        nrf_printf(dev, "[*] Validating cached image.\n");
+        nrf_image_diff(img, flash_copy, dirty_bv);
+        memset(want_bv, 0, sizeof(want_bv));
+        bitset(want_bv, 0);
+        for(page = 0; page < 64; page++){
+            if(dirty_bv[page]){
+                want_bv[page] = 0xFF;
+            } else if(nrf_image_touches(img, page)){
+                bitset(want_bv, page2block(page));
+            }
+        }
+        n += nrf_bv_count(want_bv, 512);
+        m += nrf_bv_msb(want_bv, &msb);
+        if(nrf_read_bv(dev, want_bv, check)){
+            return -2;
+        }
+        for(block = 0; block < 512; block++){
+            if(bitisset(want_bv, block) &&
+                    memcmp(&check[block2addr(block)],
+                        &flash_copy[block2addr(block)], 64)){
+                nrf_printf(dev, "[*] Cached image is stale.\n");
+                break;
+            }
+        }
+        *cached = (block == 512);
+    }
+    if(!*cached && nrf_cache_enabled(dev) && !resumed){
+        nrf_printf(dev, "[*] Reading device.\n");
+        memset(want_bv, 0xFF, sizeof(want_bv));
+        n += 512;
+        m += nrf_bv_msb(want_bv, &msb);
+        if(nrf_read_all(dev, flash_copy)){
+            return -2;
+        }
+        *cached = true;
+    } else if(!*cached){
+        memset(want_bv, 0, sizeof(want_bv));
+        for(page = 0; page < 64; page++){
+            if(bitisset((void *)done_bv, page)){
+                continue;
+            } else if(nrf_image_covers(img, page)){
+                bitset(full_bv, page);
+            } else if(nrf_image_touches(img, page)){
+                want_bv[page] = 0xFF;
+            }
+        }
+        nrf_printf(dev, "[*] Reading device.\n");
+        n += nrf_bv_count(want_bv, 512);
+        m += nrf_bv_msb(want_bv, &msb);
+        if(nrf_read_bv(dev, want_bv, flash_copy)){
+            return -2;
+        }
+    }
+
+    /* overwrite in-memory with image contents, only marking blocks dirty if
+     * the image changes them
+     */
+    nrf_image_diff(img, flash_copy, dirty_bv);
+    nrf_image_apply(img, flash_copy);
+    for(page = 0; page < 64; page++){
+        if(bitisset(full_bv, page)){
+            dirty_bv[page] = 0xFF;
+        }
+        if(bitisset((void *)done_bv, page)){
+            dirty_bv[page] = 0;
+        }
+    }
+
+    if(plan){
+        plan->reads = n;
+        plan->msb = m;
+    }
+    return 0;
+}
+
+
+/* mark each page in confirmed_bv whose dirty blocks have all been verified */
+static void nrf_confirm(const unsigned char *dirty_bv,
+        const unsigned char *verified_bv, unsigned char *confirmed_bv){
+    int page;
+
+    for(page = 0; page < 64; page++){
+        if(dirty_bv[page] && (dirty_bv[page] & ~verified_bv[page]) == 0){
+            bitset(confirmed_bv, page);
+        }
+    }
+}
+
+
+/* write img to device */
+int nrf_program_image(devp dev, const struct nrf_image *img){
+    unsigned char *flash_copy = NULL, *check = NULL, dirty_bv[64];
+    unsigned char confirmed_bv[8], written_bv[64], verified_bv[64];
+    unsigned char prev_bv[2][64], sent_bv[8], tries[64], cmd[2];
+    struct nrf_check status[64][9], verify[512];
+    struct nrf_queue q;
+    struct nrf_journal j;
+    int ecode, block, page, attempt, failed = -1, resumed = 0;
+    bool cached = false;
+
+    j.fp = NULL;
+    memset(j.done_bv, 0, sizeof(j.done_bv));
+    memset(confirmed_bv, 0, sizeof(confirmed_bv));
+    memset(written_bv, 0, sizeof(written_bv));
+    memset(verified_bv, 0, sizeof(verified_bv));
+    memset(tries, 0, sizeof(tries));
+    if(nrf_queue_init(&q, dev)){
+        ecode = -4;
+        goto err;
+    }
+    if(journal_fn){
+        if((resumed = nrf_journal_open(dev, img, &j)) < 0){
+            ecode = resumed;
+            goto err;
+        }
+        if(resumed){
+            nrf_printf(dev, "[*] Resuming, %d page(s) already written.\n",
+                    resumed);
+        }
+    }
+
+    if((flash_copy = malloc(FLASH_SIZE)) == NULL ||
+            (check = malloc(FLASH_SIZE)) == NULL){
+        ecode = -4;
+        goto err;
+    }
+    if((ecode = nrf_prepare(dev, img, j.done_bv, resumed != 0, flash_copy,
+                    check, dirty_bv, &cached, NULL))){
+        goto err;
+    }
+
+    /* write and verify
+     *
+     * Everything is queued: each page write goes out as one chain, and the
+     * verify reads of a page sit right behind it, so they are answered while
+     * the next page is still being sent instead of in a second pass. After a
+     * failed transfer the loader is resynced and the work not done yet is
+     * queued again: pages whose write statuses did not all come back are
+     * written again, and blocks not verified yet are read again. Each page
+     * may be lost RETRIES times in a row without getting any further before
+     * the write gives up, so one lost transfer costs no other page any of
+     * its tries.
+     */
+    nrf_printf(dev, "[*] Writing and verifying device");
+    for(;;){
+        memset(sent_bv, 0, sizeof(sent_bv));
+        memcpy(prev_bv[0], written_bv, sizeof(written_bv));
+        memcpy(prev_bv[1], verified_bv, sizeof(verified_bv));
+        for(page = 0; page < 64 && !q.error; page++){
+            /* Each page is 8 blocks, which conviently maps to our dirty bit
+             * vector on byte boundries.
+             */
+            if(!dirty_bv[page] || bitisset(confirmed_bv, page)){
+                continue;
+            }
+            nrf_tick(dev);
+            bitset(sent_bv, page);
+            if(!bitisset(written_bv, page2block(page + 1) - 1)){
+                /* a new write undoes what was verified before */
+                verified_bv[page] = 0;
+                if(nrf_queue_page(&q, page, &flash_copy[page2addr(page)],
+                            status[page], &failed, written_bv)){
+                    break;
+                }
+            }
+            for(block = page2block(page); block < page2block(page + 1);
+                    block++){
+                if(!bitisset(dirty_bv, block) || bitisset(verified_bv, block)){
+                    continue;
+                }
+                if(dev->msb != (int)(block / 0x100) &&
+                        (nrf_queue_drain(&q) ||
+                         nrf_set_msb(dev, block / 0x100))){
+                    /* a failed nrf_set_msb() leaves the queue itself clean */
+                    nrf_queue_abort(&q, -2);
+                    break;
+                }
+                verify[block].block = block;
+                verify[block].expect = &flash_copy[block2addr(block)];
+                verify[block].failed = &failed;
+                verify[block].confirmed = verified_bv;
+                cmd[0] = 0x03;
+                cmd[1] = (unsigned char)block;
+                if(nrf_queue_cmd(&q, cmd, 2, &check[block2addr(block)], 64,
+                            nrf_check_cb, &verify[block])){
+                    break;
+                }
+            }
+            if(j.fp){
+                nrf_confirm(dirty_bv, verified_bv, confirmed_bv);
+                nrf_journal_sync(&j, confirmed_bv);
+            }
+        }
+        ecode = nrf_queue_drain(&q);
+        nrf_confirm(dirty_bv, verified_bv, confirmed_bv);
+        if(j.fp){
+            nrf_journal_sync(&j, confirmed_bv);
+        }
+        /* a failed transfer is charged to the page it was for, a bad status
+         * or a failed verify is final
+         */
+        if(ecode == 0 || (ecode != -1 && ecode != -2)){
+            break;
+        }
+        for(page = 0; page < 64; page++){
+            if(written_bv[page] != prev_bv[0][page] ||
+                    verified_bv[page] != prev_bv[1][page]){
+                /* the page got further, its count starts over */
+                tries[page] = 0;
+            }
+        }
+        attempt = nrf_charge(tries, 64, q.lost ?
+                block2page(((struct nrf_check *)q.lost)->block) : -1,
+                sent_bv, confirmed_bv);
+        if(attempt > RETRIES || nrf_retry(dev, attempt - 1)){
+            break;
+        }
+        q.error = 0;
+        q.lost = NULL;
+    }
+    if(ecode){
+        if(ecode == -8 && failed >= 0){
+            nrf_printf(dev, "\n[!] Block %d failed.\n", failed);
+        } else if(ecode == -8){
+            nrf_printf(dev, "\n[!] Verify failed.\n");
+        } else if(failed >= 0){
+            nrf_printf(dev, "\n[!] Write failed at block %d.\n", failed);
+            ecode = -7;
+        } else {
+            nrf_printf(dev, "\n[!] Write failed.\n");
+            ecode = -7;
+        }
+        nrf_cache_drop(dev);
+        goto err;
+    }
+    nrf_printf(dev, "\n");
+
+    if(cached){
+        nrf_cache_save(dev, flash_copy);
+    }
+    if(j.fp){
+        /* nothing left to resume */
+        fclose(j.fp);
+        j.fp = NULL;
+        remove(j.fn);
+    }
+
+    ecode = 0;
+err:
+    if(j.fp){
+        fclose(j.fp);
+    }
+    if(flash_copy){
+        free(flash_copy);
+    }
+    if(check){
+        free(check);
+    }
+    nrf_queue_free(&q);
+    return ecode;
+}
+
+
+/* write the n files in fns to device, overlaid */
+int nrf_program(devp dev, char *const *fns, int n){
+    struct nrf_image *img;
+    int ecode;
+
+    if((img = malloc(sizeof(*img))) == NULL){
+        return -4;
+    }
+    if((ecode = nrf_load_images(img, fns, n, nrf_write_limit())) == 0){
+        ecode = nrf_program_image(dev, img);
+    }
+    free(img);
+    return ecode;
+}
+
+
+/* work out what writing img would take, without writing anything
+ *
+ * The device is read exactly as nrf_program_image() would read it, so the
+ * counts are the ones a write would see right now. Address MSB changes are
+ * counted for the reads as well as for the verifies, each costs a 0x06. The
+ * estimate multiplies them by the per-command costs measured on this host,
+ * see nrf_cost_sample(), and is only made if every command class the write
+ * needs has been measured. Journals are not consulted.
+ */
+int nrf_plan_image(devp dev, const struct nrf_image *img,
+        struct nrf_plan *plan){
+    unsigned char *flash_copy = NULL, *check = NULL, dirty_bv[64], done_bv[8];
+    int ecode, page, block, msb;
+    bool cached;
+
+    memset(plan, 0, sizeof(*plan));
+    memset(done_bv, 0, sizeof(done_bv));
+    if((flash_copy = malloc(FLASH_SIZE)) == NULL ||
+            (check = malloc(FLASH_SIZE)) == NULL){
+        ecode = -4;
+        goto err;
+    }
+    if((ecode = nrf_prepare(dev, img, done_bv, false, flash_copy, check,
+                    dirty_bv, &cached, plan))){
+        goto err;
+    }
+
+    /* the same order nrf_program_image() writes and verifies in */
+    msb = dev->msb;
+    for(page = 0; page < 64; page++){
+        if(!dirty_bv[page]){
+            continue;
+        }
+        plan->erases++;
+        plan->blocks += 8;
+        for(block = page2block(page); block < page2block(page + 1); block++){
+            if(!bitisset(dirty_bv, block)){
+                continue;
+            }
+            if(msb != (int)(block / 0x100)){
+                msb = block / 0x100;
+                plan->msb++;
+            }
+            plan->verifies++;
+        }
+    }
+    plan->transfers = 2 * (plan->reads + plan->erases + plan->blocks +
+            plan->verifies + plan->msb);
+
+    if(plan->reads + plan->verifies && !dev->cost[0x03]){
+        plan->missing |= 1U << 0x03;
+    }
+    if(plan->erases && !dev->cost[0x02]){
+        plan->missing |= 1U << 0x02;
+    }
+    if(plan->blocks && !dev->cost[0x00]){
+        plan->missing |= 1U << 0x00;
+    }
+    if(plan->msb && !dev->cost[0x06]){
+        plan->missing |= 1U << 0x06;
+    }
+    if(plan->missing == 0){
+        plan->calibrated = true;
+        plan->est_us = (uint64_t)(plan->reads + plan->verifies) *
+            dev->cost[0x03] + (uint64_t)plan->erases * dev->cost[0x02] +
+            (uint64_t)plan->blocks * dev->cost[0x00] +
+            (uint64_t)plan->msb * dev->cost[0x06];
+    }
+
+    ecode = 0;
+err:
+    if(flash_copy){
+        free(flash_copy);
+    }
+    if(check){
+        free(check);
+    }
+    return ecode;
+}
+
+
+/* calibration file
+ *
+ * Keeps the per-command costs of nrf_cost_sample() between runs, so an
+ * estimate can use classes this run has not measured yet, such as page
+ * writes for a plan. Costs depend on the host, hub and cable, so each station
+ * keeps its own. One record per line, costs in us:
+ *   nrfdude-calibration 1
+ *   class <n> <us>
+ */
+#define CALIB_MAGIC         "nrfdude-calibration 1"
+
+
+/* seed dev's costs from fn, -1 if it cannot be read */
+int nrf_calib_load(devp dev, const char *fn){
+    char line[96];
+    unsigned cls;
+    unsigned long us;
+    FILE *fp;
+
+    if((fp = fopen(fn, "r")) == NULL){
+        return -1;
+    }
+    if(fgets(line, sizeof(line), fp) == NULL ||
+            strncmp(line, CALIB_MAGIC "\n", sizeof(line))){
+        fclose(fp);
+        return -1;
+    }
+    while(fgets(line, sizeof(line), fp)){
+        if(sscanf(line, "class %u %lu", &cls, &us) == 2 && cls < 8 &&
+                us <= UINT32_MAX){
+            dev->cost[cls] = (uint32_t)us;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+
+/* save dev's costs to fn, replacing it in one step */
+int nrf_calib_save(devp dev, const char *fn){
+    char tmp[PATH_MAX + 4];
+    FILE *fp;
+    int cls;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", fn);
+    if((fp = fopen(tmp, "w")) == NULL){
+        return -1;
+    }
+    fprintf(fp, "%s\n", CALIB_MAGIC);
+    for(cls = 0; cls < 8; cls++){
+        if(dev->cost[cls]){
+            fprintf(fp, "class %d %u\n", cls, dev->cost[cls]);
+        }
+    }
+    if(fclose(fp) || rename(tmp, fn)){
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+
+static bool nrf_differs(const struct nrf_image *img,
+        const unsigned char *flash, unsigned addr){
+    return bitisset((void *)img->mask, addr) && flash[addr] != img->data[addr];
+}
+
+
+/* compare the bytes img covers with the device, 0 if they all match
+ *
+ * Only blocks the image covers are read, queued like any other read. Unless
+ * 'all' is set, the first block that differs ends the read and the first
+ * differing byte is reported. With 'all', every block is read and each run
+ * of differing bytes is reported. Returns -8 when anything differs.
+ */
+int nrf_verify_image(devp dev, const struct nrf_image *img, bool all){
+    unsigned char *flash = NULL, want_bv[64];
+    unsigned addr, end, ranges = 0, bytes = 0;
+    int ecode, block;
+
+    if((flash = malloc(FLASH_SIZE)) == NULL){
+        ecode = -4;
+        goto err;
+    }
+    memset(want_bv, 0, sizeof(want_bv));
+    for(block = 0; block < 512; block++){
+        if(memnotchr(&img->mask[block2addr(block) / 8], 0x00, 8)){
+            bitset(want_bv, block);
+        }
+    }
+    /* blocks an early stop never read must not look different */
+    memcpy(flash, img->data, FLASH_SIZE);
+    ecode = nrf_read_blocks(dev, want_bv, flash, all ? NULL : img);
+    if(ecode && ecode != -8){
+        ecode = -2;
+        goto err;
+    }
+
+    for(addr = 0; addr < FLASH_SIZE; addr = end){
+        for(end = addr; end < FLASH_SIZE && nrf_differs(img, flash, end);
+                end++);
+        if(end == addr){
+            end++;
+            continue;
+        }
+        ecode = -8;
+        if(!all){
+            nrf_printf(dev, "[!] Verify failed at 0x%04X.\n", addr);
+            goto err;
+        }
+        nrf_printf(dev, "[!] Differs at 0x%04X-0x%04X\n", addr, end - 1);
+        ranges++;
+        bytes += end - addr;
+    }
+    if(ranges){
+        nrf_printf(dev, "[!] %u bytes differ in %u range(s).\n", bytes, ranges);
+    }
+
+err:
+    if(flash){
+        free(flash);
+    }
+    return ecode;
+}
+
+
+int nrf_compare(devp dev, const char *fn, bool all){
+    struct nrf_image *img;
+    int ecode;
+
+    if((img = malloc(sizeof(*img))) == NULL){
+        return -4;
+    }
+    if((ecode = nrf_load_reference(img, (char *const *)&fn, 1)) == 0){
+        ecode = nrf_verify_image(dev, img, all);
+    }
+    free(img);
+    return ecode;
+}
+
+
+const char *nrf_version_str(devp dev){
+    static unsigned char vercmd = 0x01;
+    unsigned char verbin[2];
+
+    if(nrf_cmd(dev, &vercmd, 1, verbin, sizeof(verbin))){
+        return "?.?";
+    } else {
+        dev->version[0] = verbin[0] + '0';
+        dev->version[1] = '.';
+        dev->version[2] = verbin[0] + '0';
+        dev->version[3] = '\0';
+        return dev->version;
+    }
+}
+
+
+/* release and close a loader */
+void nrf_close(devp dev){
+    if(dev->tp){
+        dev->tp->close(dev);
+        dev->tp = NULL;
+    }
+}
@@ -0,0 +1,287 @@
+/* nrf.h: nRF24LU1+ USB loader protocol
+ *
+ * Copyright (C) 2012 Tristan Willy <tristan.willy at gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef NRF_H
+#define NRF_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <libusb.h>
+
+#define DEVSTRNAME          "nRF24LU1+"
+#define VENDOR_NORDIC       0x1915
+#define PID_NRF24LU         0x0101
+#define FLASH_SIZE          32768
+#define IN                  0x81
+#define OUT                 0x01
+#define TIMEOUT             2000    /* ms, the longest a transfer may take */
+#define TIMEOUT_MIN         100     /* ms, the shortest adaptive timeout */
+#define RETRIES             3
+#define BACKOFF_MIN         10      /* ms, doubles with every retry */
+#define BACKOFF_MAX         100
+#define BOOTLOADER_VECTOR   0x7800U
+#define QUEUE_DEPTH         8
+
+
+struct nrf_dev;
+
+/* typedef because libusb has terrible names */
+typedef struct nrf_dev * devp;
+
+
+/* one bulk transfer handed to a transport
+ *
+ * 'next' and 'due' belong to the transport while the transfer is in flight.
+ */
+enum nrf_xfer_status {
+    NRF_XFER_OK = 0,
+    NRF_XFER_ERROR,
+    NRF_XFER_TIMEOUT,
+    NRF_XFER_CANCELLED,
+};
+
+struct nrf_xfer {
+    devp dev;
+    unsigned char endpoint;
+    unsigned char *buffer;
+    int length;
+    int actual_length;
+    enum nrf_xfer_status status;
+    void (*callback)(struct nrf_xfer *x);
+    void *user_data;
+    void *priv;             /* transport private */
+    struct nrf_xfer *next;
+    uint64_t due;
+    uint64_t start;         /* submit time, CLOCK_MONOTONIC ns */
+    int timeout;            /* ms, 0 for TIMEOUT */
+};
+
+
+/* transport
+ *
+ * Everything above nrf_cmd() and the command queue talks to the loader through
+ * one of these, so the protocol code runs the same on a real device (usb.c)
+ * and on the simulated loader (sim.c).
+ *
+ *  xfer_init/xfer_free : per-transfer setup, called once per queue slot
+ *  submit              : start a transfer, its callback runs from wait()
+ *  cancel              : cancel a submitted transfer
+ *  wait                : run callbacks until *completed is set
+ *  bulk                : one synchronous transfer, 'timeout' in ms, returns
+ *                        0 or a libusb error code like libusb_bulk_transfer()
+ *  poll                : run the callbacks of finished transfers without
+ *                        blocking, returns how many ran and sets *timeout to
+ *                        the ms until poll is due again, -1 if only an event
+ *                        on the transport's poll fds can make progress
+ *  close               : release the device and the transport's state
+ */
+struct nrf_transport {
+    const char *name;
+    int (*xfer_init)(struct nrf_xfer *x);
+    void (*xfer_free)(struct nrf_xfer *x);
+    int (*submit)(struct nrf_xfer *x);
+    int (*cancel)(struct nrf_xfer *x);
+    int (*wait)(devp dev, int *completed);
+    int (*bulk)(devp dev, unsigned char endpoint, void *data, int length,
+            int timeout);
+    int (*poll)(devp dev, int *timeout);
+    void (*close)(devp dev);
+};
+
+
+/* smoothed round trip time of one command class, in us, 0 before a sample */
+struct nrf_rtt {
+    uint32_t srtt;
+    uint32_t rttvar;
+};
+
+
+/* an open loader */
+struct nrf_dev {
+    const struct nrf_transport *tp;
+    void *tp_data;          /* transport private */
+    libusb_context *usb;
+    libusb_device_handle *handle;
+    const char *name;       /* bus-port path in gang mode, otherwise NULL */
+    bool quiet;             /* no status output at all */
+    char path[32];          /* bus-port path */
+    int msb;                /* loader address MSB (0x06), -1 if unknown */
+    char version[4];
+    unsigned char *mirror;  /* in-memory flash image, NULL if not kept */
+    bool mirror_valid;      /* mirror holds the current flash contents */
+    int pending;            /* responses the loader still owes us */
+    int wblocks;            /* data blocks the loader still expects */
+    struct nrf_rtt rtt[8];  /* by command class, see nrf_timeout() */
+    uint32_t cost[8];       /* us per queued command by class, 0 if unknown */
+    unsigned long retries;
+    unsigned long completed;    /* queued transfers completed */
+};
+
+
+/* a flash image to program
+ *
+ * 'mask' has one bit per byte of 'data', set for every byte the source file
+ * defines. Everything else is left alone on the device.
+ */
+struct nrf_image {
+    unsigned char data[FLASH_SIZE];
+    unsigned char mask[FLASH_SIZE / 8];
+};
+
+
+/* what a device's flash holds, see nrf_fingerprint() */
+struct nrf_fingerprint {
+    uint64_t hash;
+    uint64_t page_hash[FLASH_SIZE / 512];
+    uint64_t used;          /* bit n set if page n is not blank */
+};
+
+
+/* asynchronous command queue, see nrf.c */
+typedef int (*nrf_done_fn)(void *arg, unsigned char *ret, int retlen);
+
+struct nrf_queue;
+
+struct nrf_slot {
+    struct nrf_queue *q;
+    struct nrf_xfer out, in;
+    unsigned char cmd[64];
+    unsigned char ret[64];  /* response buffer when the caller has none */
+    int outstanding;        /* transfers in flight for this slot */
+    int idle;               /* set once outstanding drops to zero */
+    nrf_done_fn done;
+    void *arg;
+};
+
+struct nrf_queue {
+    devp dev;
+    struct nrf_slot slot[QUEUE_DEPTH];
+    int next;               /* next slot to fill */
+    int outstanding;        /* transfers in flight for the whole queue */
+    int idle;               /* set once outstanding drops to zero */
+    int error;
+    void *lost;             /* arg of the command a transfer was lost for */
+    uint64_t last;          /* when the last response arrived */
+};
+
+
+/* one checked response, see nrf_check_cb() */
+struct nrf_check {
+    int block;
+    const unsigned char *expect;
+    int *failed;
+    unsigned char *confirmed;   /* block bit vector, marked when this passes */
+    const unsigned char *mask;  /* bytes of 'expect' that count, see nrf.c */
+};
+
+
+/* what writing an image would take, see nrf_plan_image() */
+struct nrf_plan {
+    int reads;              /* blocks read to find what changes */
+    int erases;             /* pages erased and written */
+    int blocks;             /* data blocks written */
+    int verifies;           /* blocks read back */
+    int msb;                /* address MSB changes, reads and verifies */
+    int transfers;          /* USB transfers, OUT and IN */
+    unsigned missing;       /* bit n set if class n is needed but has no cost */
+    bool calibrated;        /* every command class needed has a cost */
+    uint64_t est_us;        /* estimated wall time if calibrated */
+};
+
+
+/* we should not overwrite the bootloader by default */
+extern bool protect_bootloader;
+
+/* flash image cache directory, NULL when the cache is disabled */
+extern const char *cache_dir;
+
+/* data bytes per record in dumped hex files */
+extern int hex_record_len;
+
+/* programming journal, NULL when writes are not journaled */
+extern const char *journal_fn;
+
+/* dumps, writes and compares only touch range_lo..range_hi, inclusive */
+extern unsigned range_lo, range_hi;
+
+
+/* nrf.c */
+void nrf_printf(devp dev, const char *fmt, ...);
+void nrf_tick(devp dev);
+unsigned block2addr(unsigned block);
+unsigned addr2block(unsigned addr);
+unsigned page2block(unsigned page);
+unsigned block2page(unsigned block);
+unsigned page2addr(unsigned page);
+unsigned addr2page(unsigned addr);
+bool addr_valid(unsigned addr);
+unsigned nrf_write_limit(void);
+void bitset(void *bv, int bit);
+bool bitisset(void *bv, int bit);
+const void *memnotchr(const void *s, int c, size_t n);
+int nrf_cmd(devp dev, void *cmd, int cmdlen, void *ret, int retlen);
+int nrf_queue_init(struct nrf_queue *q, devp dev);
+void nrf_queue_abort(struct nrf_queue *q, int error);
+int nrf_queue_drain(struct nrf_queue *q);
+void nrf_queue_free(struct nrf_queue *q);
+int nrf_queue_cmd(struct nrf_queue *q, const void *cmd, int cmdlen, void *ret,
+        int retlen, nrf_done_fn done, void *arg);
+int nrf_check_cb(void *arg, unsigned char *ret, int retlen);
+int nrf_got_cb(void *arg, unsigned char *ret, int retlen);
+int nrf_set_msb(devp dev, int msb);
+int nrf_read_bv(devp dev, const void *want_bv, unsigned char *flash);
+int nrf_read_all(devp dev, unsigned char *flash);
+const char *nrf_cache_default_dir(void);
+int nrf_cache_load(devp dev, unsigned char *flash);
+int nrf_cache_save(devp dev, const unsigned char *flash);
+void nrf_cache_drop(devp dev);
+int nrf_dump(devp dev, const char *fn, const struct nrf_image *ref);
+int nrf_queue_page(struct nrf_queue *q, int page, const void *data,
+        struct nrf_check *status, int *failed, unsigned char *written);
+int nrf_write_page(devp dev, int page, void *data);
+int nrf_compare_block(devp dev, int block, void *data);
+int nrf_load_ihex(struct nrf_image *img, const char *fn, unsigned limit);
+int nrf_load_images(struct nrf_image *img, char *const *fns, int n,
+        unsigned limit);
+int nrf_load_reference(struct nrf_image *img, char *const *fns, int n);
+bool nrf_image_touches(const struct nrf_image *img, int page);
+bool nrf_image_covers(const struct nrf_image *img, int page);
+void nrf_image_diff(const struct nrf_image *img,
+        const unsigned char *flash_copy, unsigned char *dirty_bv);
+void nrf_image_apply(const struct nrf_image *img, unsigned char *flash_copy);
+uint64_t nrf_image_hash(const struct nrf_image *img);
+int nrf_image_save(const struct nrf_image *img, const char *fn);
+void nrf_fingerprint(const unsigned char *flash, struct nrf_fingerprint *fp);
+int nrf_program_image(devp dev, const struct nrf_image *img);
+int nrf_program(devp dev, char *const *fns, int n);
+int nrf_plan_image(devp dev, const struct nrf_image *img,
+        struct nrf_plan *plan);
+int nrf_calib_load(devp dev, const char *fn);
+int nrf_calib_save(devp dev, const char *fn);
+int nrf_verify_image(devp dev, const struct nrf_image *img, bool all);
+int nrf_compare(devp dev, const char *fn, bool all);
+const char *nrf_version_str(devp dev);
+void nrf_close(devp dev);
+
+/* usb.c */
+extern const struct nrf_transport nrf_usb_transport;
+void nrf_usb_path(libusb_device *usbdev, char *path, size_t len);
+bool nrf_usb_match(libusb_device *usbdev);
+int nrf_setup(devp dev);
+
+#endif
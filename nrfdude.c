@@ -22,493 +22,1182 @@
 #include <libusb.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
 #include "ihex.h"
+#include "nrf.h"
+#include "patch.h"
+#include "sim.h"
+#include "trace.h"
 
 #define VERSION_STRING      "0.1.0"
-#define DEVSTRNAME          "nRF24LU1+"
-#define VENDOR_NORDIC       0x1915
-#define PID_NRF24LU         0x0101
-#define FLASH_SIZE          32768
-#define IN                  0x81
-#define OUT                 0x01
-#define TIMEOUT             2000
-#define BOOTLOADER_VECTOR   0x7800U
-
-
-/* typedef because libusb has terrible names */
-typedef libusb_device_handle * devp;
-
-
-/* we should not overwrite the bootloader by default */
-static bool protect_bootloader = true;
+#define MAX_IMAGES          16      /* -w files overlaid in one write */
+#define MAX_PATCHES         8
 
 
 static void print_help(void){
     printf( "Usage: nrfdude [options]\n"
             "Options:\n"
+            " -a <lo>-<hi>          : Only read, write and compare"
+                " <lo>-<hi> (inclusive)\n"
+            " -C <file>             : Like -c, listing every range that"
+                " differs\n"
+            " -c <file>             : Compare device with <file>, exit 2"
+                " if it differs\n"
+            " -D <file>             : Make -r dump only the blocks that"
+                " differ from <file>\n"
+            " -d <socket>           : Serve jobs for every attached device on"
+                " a Unix socket\n"
+            " -g                    : Gang mode: use every attached device\n"
             " -h                    : This message\n"
+            " -i                    : Inventory: fingerprint every attached"
+                " device as JSON\n"
+            " -j <file>             : Journal writes to <file> so a failed"
+                " write resumes\n"
+            " -K <file>             : Load and save per-command costs in"
+                " <file>, see -P\n"
+            " -k                    : Cache flash contents between runs\n"
+            " -L                    : Production line: program every loader"
+                " that attaches\n"
+            " -l <len>              : Dump <len> bytes per record"
+                " (16, 32, 64)\n"
+            " -o <file>             : Compile the -w files into an image"
+                " file and exit\n"
+            " -P                    : Plan -w: print pages to erase and"
+                " time, write nothing\n"
+            " -p <addr:width:src>   : Patch a per-device field into -w,"
+                " see README\n"
             " -r <file>             : Read from device to <file>\n"
-            " -w <file>             : Write from <file> to device\n"
+            " -s <spec>             : Use a simulated device, see README\n"
+            " -t <file>             : Trace USB transfers to <file>"
+                " (.json or CSV)\n"
+            " -w <file>             : Write from <file> to device, repeat to"
+                " overlay files\n"
             " -x                    : Allow writing to 0x7800-0x7FFF"
                 " (bootloader)\n");
 }
 
 
-/* address translation functions
-
- * The nRF24LU1+ has 32KiB of flash memory. It is divided into 64 pages with
- * each page holding 8 blocks of 64 bytes.
+/* inventory scan
  *
- * Address types from least to most granular: page, block, addr
- *
- * Translation to a higher granularity address is exact. Translation to a lower
- * granularity address is inexact. Inexact translations are floor operations,
- * so addresses are rounded towards zero.
+ * -i reads every attached loader, in parallel like gang mode, and prints one
+ * line of JSON per device with its loader version, a hash of all of flash, a
+ * hash of every page and a map of the pages that are not blank. Nothing is
+ * written to disk.
  */
-unsigned block2addr(unsigned block){
-    return block * 64;
-}
-unsigned addr2block(unsigned addr){
-    return addr / 64;
-}
-unsigned page2block(unsigned page){
-    return page * 8;
-}
-unsigned block2page(unsigned block){
-    return block / 8;
-}
-unsigned page2addr(unsigned page){
-    return block2addr(page2block(page));
-}
-unsigned addr2page(unsigned addr){
-    return block2page(addr2block(addr));
-}
-
-
-/* bit vector manipulation */
-void bitset(void *bv, int bit){
-    unsigned char *bbv = (unsigned char *)bv;
+static int scan_device(devp dev, struct nrf_fingerprint *fp){
+    unsigned char *flash;
+    int ecode;
 
-    bbv[bit / 8] |= 1U << (bit % 8);
+    if((flash = malloc(FLASH_SIZE)) == NULL){
+        return -4;
+    }
+    if((ecode = nrf_read_all(dev, flash)) == 0){
+        nrf_fingerprint(flash, fp);
+    }
+    free(flash);
+    return ecode;
 }
 
 
-bool bitisset(void *bv, int bit){
-    unsigned char *bbv = (unsigned char *)bv;
+static void scan_print(const char *path, const char *version,
+        const struct nrf_fingerprint *fp, int rc){
+    char line[64 * 19 + 256];
+    int pos, page;
 
-    return (bbv[bit / 8] & (1U << (bit % 8)));
+    pos = snprintf(line, sizeof(line), "{\"path\":\"%s\"", path);
+    if(rc){
+        printf("%s,\"error\":%d}\n", line, rc);
+        return;
+    }
+    pos += snprintf(&line[pos], sizeof(line) - pos, ",\"version\":\"%s\""
+            ",\"hash\":\"%016llx\",\"used\":\"%016llx\",\"pages\":[",
+            version, (unsigned long long)fp->hash,
+            (unsigned long long)fp->used);
+    for(page = 0; page < FLASH_SIZE / 512; page++){
+        pos += snprintf(&line[pos], sizeof(line) - pos, "%s\"%016llx\"",
+                page ? "," : "", (unsigned long long)fp->page_hash[page]);
+    }
+    printf("%s]}\n", line);
 }
 
 
-/* check if an address is valid
- *
- * Valid valid conditions:
- *  1. Within 0x0000 - 0x7FFF
- *  2. Not protected:
- *      a. Bootloader @ 0x7800 - 0x7FFF
+/* gang mode
  *
- * Don't be too smart with this. The code only checks the first, last, and any
- * block-aligned address it tries to write.
+ * Every attached loader is driven by its own thread. Each thread has a private
+ * libusb context, so the async completions of one device are never handled
+ * on another device's thread. The hex file is parsed once and shared.
  */
-static bool addr_valid(unsigned addr){
-    if((protect_bootloader && addr < BOOTLOADER_VECTOR) ||
-            (!protect_bootloader && addr < 0x8000U)){
-        return true;
-    } else {
-        return false;
-    }
+struct gang_job {
+    char path[32];
+    const struct nrf_image *img;
+    const char *r_fn;
+    pthread_t thread;
+    int dump_rc, program_rc;
+    unsigned long serial;   /* device number for -p patches */
+    unsigned long retries;
+    struct nrf_fingerprint *scan;   /* -i results, NULL when not scanning */
+    int scan_rc;
+    char version[4];
+    bool opened;
+    double attached, first_xfer;    /* monotonic seconds, line mode */
+    struct gang_job *next;
+};
+
+
+static double mono_now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
 
-/* bulk transfer */
-static int nrf_bulk(devp dev, unsigned char endpoint, void *data, int length){
-    int trans, rc;
+/* -p patches, applied to each device's copy of the image */
+static struct nrf_patch patches[MAX_PATCHES];
+static int npatches;
 
-    rc = libusb_bulk_transfer(dev, endpoint, data, length, &trans, TIMEOUT);
+/* -P: report what a write would take instead of writing */
+static bool plan_only;
 
-    return rc;
-}
+/* -D: dumps only hold what differs from this, NULL for full dumps */
+static struct nrf_image *dump_ref;
 
 
-/* locate the first byte in 's' that does not match 'c' */
-const void *memnotchr(const void *s, int c, size_t n){
-    const unsigned char *s1 = (const unsigned char *)s;
-    const unsigned char *s2 = s1 + n;
+/* print what writing img would take as one line of JSON */
+static int plan_print(devp dev, const struct nrf_image *img){
+    static const char *classes[8] = {
+        [0x00] = "data blocks", [0x02] = "page writes", [0x03] = "reads",
+        [0x06] = "address MSB",
+    };
+    struct nrf_plan plan;
+    char missing[64] = "";
+    int ecode, cls;
 
-    while(s1 != s2 && *s1 == (unsigned char)c){
-        s1++;
+    if((ecode = nrf_plan_image(dev, img, &plan))){
+        return ecode;
     }
-
-    if(s1 != s2){
-        return (const void *)s1;
+    printf("{\"path\":\"%s\",\"erases\":%d,\"blocks\":%d,\"reads\":%d,"
+            "\"verifies\":%d,\"transfers\":%d,", dev->path, plan.erases,
+            plan.blocks, plan.reads, plan.verifies, plan.transfers);
+    if(plan.calibrated){
+        printf("\"estimate_ms\":%llu}\n",
+                (unsigned long long)(plan.est_us + 999) / 1000);
     } else {
-        return NULL;
+        printf("\"estimate_ms\":null}\n");
+        for(cls = 0; cls < 8; cls++){
+            if(plan.missing & (1U << cls) && classes[cls]){
+                strcat(missing, missing[0] ? ", " : "");
+                strcat(missing, classes[cls]);
+            }
+        }
+        nrf_printf(dev, "[!] No cost for %s, see -K.\n", missing);
+    }
+    nrf_printf(dev, "[*] Plan: %d page(s) to erase, %d transfers.\n",
+            plan.erases, plan.transfers);
+    return 0;
+}
+
+
+static int program_one(devp dev, const struct nrf_image *img){
+    return plan_only ? plan_print(dev, img) : nrf_program_image(dev, img);
+}
+
+
+/* program img with every patch applied for device number 'serial' */
+static int program_patched(devp dev, const struct nrf_image *img,
+        unsigned long serial){
+    struct nrf_image *copy;
+    int ecode = 0, i;
+
+    if(npatches == 0){
+        return program_one(dev, img);
     }
+    if((copy = malloc(sizeof(*copy))) == NULL){
+        return -4;
+    }
+    memcpy(copy, img, sizeof(*copy));
+    for(i = 0; i < npatches; i++){
+        if((ecode = nrf_patch_apply(&patches[i], copy, serial, dev->path))){
+            nrf_printf(dev, "[!] Patch %d failed for device #%lu: %d\n",
+                    i + 1, serial, ecode);
+            break;
+        }
+    }
+    if(ecode == 0){
+        nrf_printf(dev, "[*] Patched as device #%lu\n", serial);
+        ecode = program_one(dev, copy);
+    }
+    free(copy);
+    return ecode;
 }
 
 
-/* execute one command */
-int nrf_cmd(devp dev, void *cmd, int cmdlen, void *ret, int retlen){
-    if(nrf_bulk(dev, OUT, cmd, cmdlen)){
+/* open and set up the loader at bus-port 'path' in a libusb context of its
+ * own, since nrf_close() tears the context down with the device
+ */
+static int open_path(devp dev, const char *path, bool attached){
+    libusb_device **list = NULL;
+    char found[32];
+    ssize_t n, i;
+    int tries;
+
+    if(libusb_init(&dev->usb)){
         return -1;
     }
-    if(nrf_bulk(dev, IN, ret, retlen)){
-        return -2;
+    dev->tp = &nrf_usb_transport;
+    libusb_set_debug(dev->usb, 0);
+    /* a freshly attached device can take a moment to show up in a new
+     * context
+     */
+    for(tries = 0; tries < 20 && dev->handle == NULL; tries++){
+        if(tries){
+            usleep(50000);
+        }
+        if((n = libusb_get_device_list(dev->usb, &list)) < 0){
+            return -1;
+        }
+        for(i = 0; i < n; i++){
+            nrf_usb_path(list[i], found, sizeof(found));
+            if(nrf_usb_match(list[i]) && strcmp(found, path) == 0){
+                if(libusb_open(list[i], &dev->handle)){
+                    dev->handle = NULL;
+                }
+                break;
+            }
+        }
+        libusb_free_device_list(list, 1);
+        if(i < n || !attached){
+            /* found it, or it was seen in a list and is gone */
+            break;
+        }
+    }
+    if(dev->handle == NULL || nrf_setup(dev)){
+        return -1;
     }
     return 0;
 }
 
 
-/* dump all of device flash to fn */
-int nrf_dump(devp dev, const char *fn){
-    unsigned char cmd[2], data[64];
-    FILE *fp = NULL;
-    int ecode, block, sub_block;
-    IHexRecord record;
+static void *gang_worker(void *arg){
+    struct gang_job *job = (struct gang_job *)arg;
+    struct nrf_dev nrf;
+    devp dev = &nrf;
+    char fn[PATH_MAX];
 
-    if((fp = fopen(fn, "w+")) == NULL){
-        ecode = -1;
+    memset(dev, 0, sizeof(*dev));
+    dev->name = job->path;
+    dev->quiet = job->scan != NULL;
+    if(open_path(dev, job->path, job->attached != 0)){
         goto err;
     }
+    job->opened = true;
 
-    /* dump */
-    for(block = 0; block < 0x200; block++){
-        /* set address MSB */
-        if((block % 0x100) == 0){
-            cmd[0] = 0x06;
-            cmd[1] = (unsigned char)(block / 256);
-            if(nrf_cmd(dev, cmd, 2, data, 1)){
-                ecode = -2;
-                goto err;
-            }
+    job->first_xfer = mono_now();
+    snprintf(job->version, sizeof(job->version), "%s", nrf_version_str(dev));
+    nrf_printf(dev, "[*] %s version %s\n", DEVSTRNAME, job->version);
+    if(job->scan){
+        job->scan_rc = scan_device(dev, job->scan);
+    }
+    if(job->r_fn){
+        snprintf(fn, sizeof(fn), "%s.%s", job->r_fn, job->path);
+        nrf_printf(dev, "[*] Dumping device to %s\n", fn);
+        job->dump_rc = nrf_dump(dev, fn, dump_ref);
+    }
+    if(job->img){
+        nrf_printf(dev, "[*] Programming device\n");
+        job->program_rc = program_patched(dev, job->img, job->serial);
+    }
+
+err:
+    job->retries = dev->retries;
+    nrf_close(dev);
+    return NULL;
+}
+
+
+/* order bus-port paths numerically, so "1-2" comes before "1-10" */
+static int path_cmp(const char *p, const char *q){
+    unsigned long x, y;
+    char *end;
+
+    while(*p && *q){
+        x = strtoul(p, &end, 10);
+        p = *end ? end + 1 : end;
+        y = strtoul(q, &end, 10);
+        q = *end ? end + 1 : end;
+        if(x != y){
+            return x < y ? -1 : 1;
         }
-        /* request the block */
-        cmd[0] = 0x03;
-        cmd[1] = (unsigned char)block;
-        if(nrf_cmd(dev, cmd, 2, data, 64)){
-            ecode = -2;
+    }
+    return (*p != '\0') - (*q != '\0');
+}
+
+
+static int gang_job_cmp(const void *a, const void *b){
+    return path_cmp(((const struct gang_job *)a)->path,
+            ((const struct gang_job *)b)->path);
+}
+
+
+static int dev_cmp(const void *a, const void *b){
+    return path_cmp(((const struct nrf_dev *)a)->path,
+            ((const struct nrf_dev *)b)->path);
+}
+
+
+/* dump, program and/or scan every attached loader at once */
+int gang_run(libusb_context *usb, const char *r_fn, char *const *w_fns,
+        int nw, bool scan){
+    struct nrf_image *img = NULL;
+    struct nrf_fingerprint *fps = NULL;
+    struct gang_job *jobs = NULL;
+    libusb_device **list = NULL;
+    int ecode, njobs = 0, failed = 0, i, rc;
+    ssize_t n;
+
+    /* parse once, program many */
+    if(nw){
+        if((img = malloc(sizeof(*img))) == NULL){
+            ecode = -4;
             goto err;
         }
-        /* write two records for this block
-         * records are only written if the block contains something not 0xFF
-         */
-        for(sub_block = 0; sub_block < 2; sub_block++){
-            record.type = IHEX_TYPE_00;
-            memcpy(record.data, &data[sub_block * 32], 32);
-            record.dataLen = 32;
-            record.address = block * 64 + sub_block * 32;
-            if(memnotchr(record.data, 0xFF, 32) &&
-                    Write_IHexRecord(&record, fp)){
-                ecode = -3;
-                goto err;
-            }
+        if((rc = nrf_load_images(img, w_fns, nw, nrf_write_limit()))){
+            ecode = rc;
+            goto err;
         }
     }
 
-    /* write EoF record */
-    record.type = IHEX_TYPE_01;
-    record.address = 0;
-    record.dataLen = 0;
-    if(Write_IHexRecord(&record, fp)){
-        ecode = -3;
+    if((n = libusb_get_device_list(usb, &list)) < 0 ||
+            (jobs = calloc(n ? n : 1, sizeof(*jobs))) == NULL ||
+            (scan && (fps = calloc(n ? n : 1, sizeof(*fps))) == NULL)){
+        ecode = -4;
+        goto err;
+    }
+    for(i = 0; i < n; i++){
+        if(nrf_usb_match(list[i])){
+            nrf_usb_path(list[i], jobs[njobs].path, sizeof(jobs[njobs].path));
+            njobs++;
+        }
+    }
+    libusb_free_device_list(list, 1);
+
+    /* libusb lists devices in no particular order, serials follow the ports */
+    qsort(jobs, njobs, sizeof(*jobs), gang_job_cmp);
+    for(i = 0; i < njobs; i++){
+        jobs[i].img = img;
+        jobs[i].r_fn = r_fn;
+        jobs[i].serial = i;
+        jobs[i].scan = fps ? &fps[i] : NULL;
+    }
+    if(njobs == 0){
+        fprintf(stderr, "[!] No %04X:%04X devices found.\n", VENDOR_NORDIC,
+                PID_NRF24LU);
+        ecode = -1;
         goto err;
     }
+    fprintf(stderr, "[*] Found %d %s device(s).\n", njobs, DEVSTRNAME);
 
-    ecode = 0;
+    for(i = 0; i < njobs; i++){
+        if(pthread_create(&jobs[i].thread, NULL, gang_worker, &jobs[i])){
+            /* run it here instead */
+            gang_worker(&jobs[i]);
+            jobs[i].thread = pthread_self();
+        }
+    }
+    for(i = 0; i < njobs; i++){
+        if(!pthread_equal(jobs[i].thread, pthread_self())){
+            pthread_join(jobs[i].thread, NULL);
+        }
+    }
+
+    /* summary */
+    for(i = 0; i < njobs; i++){
+        if(scan){
+            rc = jobs[i].opened ? jobs[i].scan_rc : -1;
+            scan_print(jobs[i].path, jobs[i].version, jobs[i].scan, rc);
+            if(rc == 0){
+                continue;
+            }
+        } else if(!jobs[i].opened){
+            fprintf(stderr, "[!] %-12s FAIL (open)\n", jobs[i].path);
+        } else if(jobs[i].dump_rc){
+            fprintf(stderr, "[!] %-12s FAIL (dump %d)\n", jobs[i].path,
+                    jobs[i].dump_rc);
+        } else if(jobs[i].program_rc){
+            fprintf(stderr, "[!] %-12s FAIL (program %d)\n", jobs[i].path,
+                    jobs[i].program_rc);
+        } else {
+            fprintf(stderr, "[*] %-12s pass, %lu retries\n", jobs[i].path,
+                    jobs[i].retries);
+            continue;
+        }
+        failed++;
+    }
+    fprintf(stderr, "[*] %d passed, %d failed.\n", njobs - failed, failed);
+
+    ecode = failed ? -9 : 0;
 err:
-    if(fp){
-        fclose(fp);
+    if(jobs){
+        free(jobs);
+    }
+    if(fps){
+        free(fps);
+    }
+    if(img){
+        free(img);
     }
     return ecode;
 }
 
 
-/* write one page to flash */
-int nrf_write_page(devp dev, int page, void *data){
-    unsigned char *b = (unsigned char *)data;
-    unsigned char cmd[2], ret;
-    int block;
+/* production line mode
+ *
+ * Loaders are picked up by a libusb hotplug callback as they attach,
+ * including any already attached at startup, and queued. The main loop hands
+ * each queued loader to its own gang worker, so a slow board never holds up
+ * the next one. The image is parsed once. Each result is reported with the
+ * time from attach to the first loader command. Ctrl-C stops taking new
+ * boards, waits for the ones in progress and prints a summary.
+ */
+static volatile sig_atomic_t line_stop;
+static pthread_mutex_t line_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t line_cond = PTHREAD_COND_INITIALIZER;
+static struct gang_job *line_queue, *line_active;
+static int line_passed, line_failed;
+static unsigned long line_serial;
 
-    if(page < 0 || page > 63){
-        /* invalid page */
-        return -1;
-    }
 
-    /* send the flash-write command */
-    cmd[0] = 0x02;
-    cmd[1] = (unsigned char)page;
-    if(nrf_cmd(dev, cmd, sizeof(cmd), &ret, sizeof(ret)) || ret){
-        return -1;
-    }
+static void line_sigint(int sig){
+    (void)sig;
+    line_stop = 1;
+}
 
-    /* send a page of memory, one block at a time */
-    for(block = 0; block < 8; block++){
-        if(nrf_cmd(dev, &b[block * 64], 64, &ret, sizeof(ret)) || ret){
-            return -2;
-        }
-    }
 
+static int line_hotplug(libusb_context *usb, libusb_device *device,
+        libusb_hotplug_event event, void *user_data){
+    struct gang_job *job, **tail;
+
+    (void)usb;
+    (void)event;
+    if((job = calloc(1, sizeof(*job))) == NULL){
+        return 0;
+    }
+    nrf_usb_path(device, job->path, sizeof(job->path));
+    job->img = (const struct nrf_image *)user_data;
+    job->attached = mono_now();
+    for(tail = &line_queue; *tail; tail = &(*tail)->next);
+    *tail = job;
     return 0;
 }
 
 
-/* compare/verify that a block on the device is identical to the one in data
- * returns result of memcpy() been device and data
- */
-int nrf_compare_block(devp dev, int block, void *data){
-    unsigned char cmd[2], devblock[64];
+static void *line_worker(void *arg){
+    struct gang_job *job = (struct gang_job *)arg, **p;
 
-    /* request the block */
-    cmd[0] = 0x03;
-    cmd[1] = (unsigned char)block;
-    if(nrf_cmd(dev, cmd, 2, devblock, 64)){
-        return -1;
+    gang_worker(job);
+
+    pthread_mutex_lock(&line_lock);
+    if(!job->opened){
+        fprintf(stderr, "[!] %-12s FAIL (open)\n", job->path);
+        line_failed++;
+    } else if(job->program_rc){
+        fprintf(stderr,
+                "[!] %-12s FAIL (program %d), %.1f ms to first transfer\n",
+                job->path, job->program_rc,
+                (job->first_xfer - job->attached) * 1e3);
+        line_failed++;
+    } else {
+        fprintf(stderr,
+                "[*] %-12s pass, %.1f ms to first transfer, %.2f s total, "
+                "%lu retries\n", job->path,
+                (job->first_xfer - job->attached) * 1e3,
+                mono_now() - job->attached, job->retries);
+        line_passed++;
     }
+    for(p = &line_active; *p != job; p = &(*p)->next);
+    *p = job->next;
+    pthread_cond_signal(&line_cond);
+    pthread_mutex_unlock(&line_lock);
 
-    return memcmp(data, devblock, 64);
+    free(job);
+    return NULL;
 }
 
 
+/* start the queued jobs, skipping loaders that are still being worked on */
+static void line_dispatch(void){
+    struct gang_job *job, *a;
 
-/* write fn to device */
-int nrf_program(devp dev, const char *fn){
-    unsigned char cmd[2], data[64], *flash_copy, dirty_bv[64];
-    FILE *fp = NULL;
-    int ecode, block, page, rc;
-    unsigned int first_addr, last_addr;
-    IHexRecord record;
-
-    /* read the entire ROM into memory
-     *
-     * Why? Because Nordic doesn't have decent software. Their flash write
-     * command erases the page first, instead of letting me decide if the page
-     * should be erased first.
-     *
-     * Byte-level writing is offered by using a read-modify-write operation.
-     * It would be smarter to operate on a per-page basis, but Intel HEX files
-     * are not guaranteed to have sequential addressing. Since Nordic screwed
-     * up and wild IHX files are adhoc, let's work with the whole 32k flash
-     * memory at once.
-     */
-    if((flash_copy = malloc(FLASH_SIZE)) == NULL){
+    while((job = line_queue)){
+        line_queue = job->next;
+        pthread_mutex_lock(&line_lock);
+        for(a = line_active; a && strcmp(a->path, job->path); a = a->next);
+        if(a){
+            pthread_mutex_unlock(&line_lock);
+            free(job);
+            continue;
+        }
+        fprintf(stderr, "[*] %-12s attached\n", job->path);
+        job->serial = line_serial++;
+        job->next = line_active;
+        line_active = job;
+        if(pthread_create(&job->thread, NULL, line_worker, job)){
+            line_active = job->next;
+            fprintf(stderr, "[!] %-12s FAIL (thread)\n", job->path);
+            line_failed++;
+            pthread_mutex_unlock(&line_lock);
+            free(job);
+            continue;
+        }
+        pthread_detach(job->thread);
+        pthread_mutex_unlock(&line_lock);
+    }
+}
+
+
+int line_run(libusb_context *usb, char *const *w_fns, int nw){
+    struct nrf_image *img = NULL;
+    libusb_hotplug_callback_handle cb;
+    struct timeval tv;
+    struct gang_job *job;
+    bool registered = false;
+    int ecode, rc;
+
+    if(!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)){
+        fprintf(stderr, "[!] libusb has no hotplug support here.\n");
+        ecode = -1;
+        goto err;
+    }
+    if((img = malloc(sizeof(*img))) == NULL){
         ecode = -4;
         goto err;
     }
-    printf("[*] Reading device.\n");
-    for(block = 0; block < 0x200; block++){
-        /* set address MSB */
-        if((block % 0x100) == 0){
-            cmd[0] = 0x06;
-            cmd[1] = (unsigned char)(block / 256);
-            if(nrf_cmd(dev, cmd, 2, data, 1)){
-                ecode = -2;
-                goto err;
-            }
+    if((rc = nrf_load_images(img, w_fns, nw, nrf_write_limit()))){
+        ecode = rc;
+        goto err;
+    }
+    if(libusb_hotplug_register_callback(usb,
+                LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_ENUMERATE,
+                VENDOR_NORDIC, PID_NRF24LU, LIBUSB_HOTPLUG_MATCH_ANY,
+                line_hotplug, img, &cb)){
+        fprintf(stderr, "[!] Failed to register for hotplug events.\n");
+        ecode = -1;
+        goto err;
+    }
+    registered = true;
+    signal(SIGINT, line_sigint);
+    fprintf(stderr, "[*] Waiting for %04X:%04X devices, Ctrl-C to stop.\n",
+            VENDOR_NORDIC, PID_NRF24LU);
+
+    while(!line_stop){
+        line_dispatch();
+        tv.tv_sec = 0;
+        tv.tv_usec = 200000;
+        libusb_handle_events_timeout_completed(usb, &tv, NULL);
+    }
+
+    /* finish what is in progress */
+    while((job = line_queue)){
+        line_queue = job->next;
+        free(job);
+    }
+    pthread_mutex_lock(&line_lock);
+    while(line_active){
+        pthread_cond_wait(&line_cond, &line_lock);
+    }
+    pthread_mutex_unlock(&line_lock);
+    fprintf(stderr, "\n[*] %d passed, %d failed.\n", line_passed, line_failed);
+
+    ecode = line_failed ? -9 : 0;
+err:
+    if(registered){
+        libusb_hotplug_deregister_callback(usb, cb);
+    }
+    if(img){
+        free(img);
+    }
+    return ecode;
+}
+
+
+/* daemon mode
+ *
+ * Every attached loader is set up once and then serves jobs from a Unix
+ * socket, one connection at a time. A job is one line:
+ *
+ *   read [@<path>] <file>      dump a device to <file>
+ *   program [@<path>] <file>   write <file> to a device
+ *   verify [@<path>] <file>    compare a device with <file>
+ *   list                       list the bus-port paths being served
+ *   shutdown                   stop the daemon
+ *
+ * and is answered with "ok" or "error <code>", "list" with "ok" and the
+ * paths. <path> picks the device by bus-port path and may be left out when
+ * only one is served. Files are opened by the daemon, so relative paths are
+ * relative to its working directory. Each device's flash contents are kept
+ * in memory between jobs.
+ */
+static int daemon_job(devp *devs, int ndevs, char *line, char *reply,
+        size_t len, bool *stop){
+    devp dev = NULL;
+    char *arg, *path;
+    int i;
+
+    line[strcspn(line, "\r\n")] = '\0';
+    if((arg = strchr(line, ' '))){
+        *arg++ = '\0';
+        arg += strspn(arg, " ");
+    }
+
+    if(strcmp(line, "shutdown") == 0){
+        *stop = true;
+        return 0;
+    }
+    if(strcmp(line, "list") == 0){
+        for(i = 0; i < ndevs; i++){
+            snprintf(reply + strlen(reply), len - strlen(reply), " %s",
+                    devs[i]->path);
         }
-        /* request the block */
-        cmd[0] = 0x03;
-        cmd[1] = (unsigned char)block;
-        if(nrf_cmd(dev, cmd, 2, &flash_copy[block2addr(block)], 64)){
-            ecode = -2;
-            goto err;
+        return 0;
+    }
+    if(arg && *arg == '@'){
+        path = arg + 1;
+        arg = path + strcspn(path, " ");
+        if(*arg){
+            *arg++ = '\0';
+            arg += strspn(arg, " ");
+        }
+        for(i = 0; i < ndevs; i++){
+            if(strcmp(devs[i]->path, path) == 0){
+                dev = devs[i];
+            }
         }
+    } else if(ndevs == 1){
+        dev = devs[0];
+    }
+    if(dev == NULL || arg == NULL || *arg == '\0'){
+        return -10;
+    }
+    if(strcmp(line, "read") == 0){
+        nrf_printf(dev, "[*] Dumping device to %s\n", arg);
+        return nrf_dump(dev, arg, NULL);
     }
+    if(strcmp(line, "program") == 0){
+        nrf_printf(dev, "[*] Programming device with %s\n", arg);
+        return nrf_program(dev, &arg, 1);
+    }
+    if(strcmp(line, "verify") != 0){
+        return -10;
+    }
+
+    nrf_printf(dev, "[*] Verifying device with %s\n", arg);
+    return nrf_compare(dev, arg, false);
+}
 
-    /* overwrite in-memory with IHX contents */
-    if((fp = fopen(fn, "r")) == NULL){
+
+int daemon_run(devp *devs, int ndevs, const char *sock_path){
+    struct sockaddr_un sa;
+    struct stat st;
+    char line[PATH_MAX + 48], reply[512];
+    FILE *in;
+    int ecode, srv = -1, fd, rc, i;
+    bool stop = false;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if(strlen(sock_path) >= sizeof(sa.sun_path)){
+        fprintf(stderr, "[!] Socket path too long: %s\n", sock_path);
         ecode = -1;
         goto err;
     }
-    memset(dirty_bv, 0, sizeof(dirty_bv));
-    while((rc = Read_IHexRecord(&record, fp)) == IHEX_OK &&
-            record.type != IHEX_TYPE_01){
-        if(record.type != IHEX_TYPE_00){
-            /* we cannot process segment or linear ihex files */
-            printf("[!] IHX file contains segment or linear addressing.\n");
-            ecode = -5;
+    strcpy(sa.sun_path, sock_path);
+    for(i = 0; i < ndevs; i++){
+        if((devs[i]->mirror = malloc(FLASH_SIZE)) == NULL){
+            ecode = -4;
             goto err;
         }
-        /* first and last byte that is touched by this record */
-        first_addr = record.address;
-        last_addr = record.address + record.dataLen - 1;
-        if(!addr_valid(first_addr) || !addr_valid(last_addr)){
-            printf("[!] IHX record touches invalid or protected bytes: "
-                    "0x%04X - 0x%04X\n", first_addr, last_addr);
-            ecode = -6;
-            goto err;
-        }
-        /* only write if the ihx record changes memory */
-        if(memcmp(&flash_copy[first_addr], record.data, record.dataLen)){
-            /* copy record into memory */
-            memcpy(&flash_copy[first_addr], record.data, record.dataLen);
-            /* mark dirty blocks */
-            for(block = addr2block(first_addr); block <= addr2block(last_addr);
-                    block++){
-                /* check the block since we might have some *really* long
-                 * record
-                 */
-                if(!addr_valid(block2addr(block))){
-                    printf("[!] IHX record touches invalid or protected bytes:"
-                            " 0x%04X\n", block2addr(block));
-                    ecode = -6;
-                    goto err;
-                }
-                bitset(dirty_bv, block);
-            }
-        }
+        devs[i]->mirror_valid = false;
     }
-    if(rc != IHEX_OK && rc != IHEX_ERROR_EOF){
-        /* we had an error that isn't EOF */
-        ecode = -4;
+
+    /* a client that hangs up early must not take us down */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* replace a socket left behind by an earlier daemon */
+    if(stat(sock_path, &st) == 0 && S_ISSOCK(st.st_mode)){
+        unlink(sock_path);
+    }
+    if((srv = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+            bind(srv, (struct sockaddr *)&sa, sizeof(sa)) ||
+            listen(srv, 8)){
+        fprintf(stderr, "[!] Failed to listen on %s: %s\n", sock_path,
+                strerror(errno));
+        ecode = -1;
         goto err;
     }
+    fprintf(stderr, "[*] Serving %d device(s) on %s\n", ndevs, sock_path);
 
-    /* write to flash */
-    printf("[*] Writing device");
-    fflush(stdout);
-    for(page = 0; page < 64; page++){
-        /* Each page is 8 blocks, which conviently maps to our dirty bit vector
-         * on byte boundries.
-         */
-        if(dirty_bv[page]){
-            printf(".");
-            fflush(stdout);
-            if(nrf_write_page(dev, page, &flash_copy[page2addr(page)])){
-                printf("\n[!] Write failed.\n");
-                ecode = -7;
-                goto err;
+    while(!stop){
+        if((fd = accept(srv, NULL, NULL)) < 0){
+            if(errno == EINTR){
+                continue;
             }
+            ecode = -1;
+            goto err;
         }
-    }
-    printf("\n");
-
-    /* verify */
-    printf("[*] Verifying device");
-    fflush(stdout);
-    for(block = 0; block < 512; block++){
-        if(bitisset(dirty_bv, block)){
-            if(nrf_compare_block(dev, block, &flash_copy[block2addr(block)])){
-                printf("\n[!] Block %d failed.\n", block);
-                ecode = -8;
-                goto err;
+        if((in = fdopen(fd, "r")) == NULL){
+            close(fd);
+            continue;
+        }
+        while(!stop && fgets(line, sizeof(line), in)){
+            reply[0] = '\0';
+            if((rc = daemon_job(devs, ndevs, line, reply, sizeof(reply),
+                            &stop))){
+                fprintf(stderr, "[!] Job failed: %d\n", rc);
+                dprintf(fd, "error %d\n", rc);
             } else {
-                printf(".");
-                fflush(stdout);
+                dprintf(fd, "ok%s\n", reply);
             }
         }
+        fclose(in);
     }
-    printf("\n");
 
     ecode = 0;
 err:
-    if(flash_copy){
-        free(flash_copy);
+    if(srv >= 0){
+        close(srv);
+        unlink(sock_path);
     }
-    if(fp){
-        fclose(fp);
+    for(i = 0; i < ndevs; i++){
+        free(devs[i]->mirror);
+        devs[i]->mirror = NULL;
+        devs[i]->mirror_valid = false;
     }
     return ecode;
 }
 
 
-const char *nrf_version_str(devp dev){
-    static unsigned char verbin[2];
-    static char verstr[4];
-    static unsigned char vercmd = 0x01;
+/* open every attached loader and serve jobs for all of them */
+static int daemon_usb(libusb_context *usb, const char *sock_path){
+    struct nrf_dev *nrfs = NULL;
+    devp *devs = NULL;
+    libusb_device **list = NULL;
+    int ecode, nfound = 0, ndevs = 0, i;
+    ssize_t n;
 
-    if(nrf_cmd(dev, &vercmd, 1, verbin, sizeof(verbin))){
-        return "?.?";
-    } else {
-        verstr[0] = verbin[0] + '0';
-        verstr[1] = '.';
-        verstr[2] = verbin[0] + '0';
-        verstr[3] = '\0';
-        return verstr;
+    if((n = libusb_get_device_list(usb, &list)) < 0 ||
+            (nrfs = calloc(n ? n : 1, sizeof(*nrfs))) == NULL ||
+            (devs = calloc(n ? n : 1, sizeof(*devs))) == NULL){
+        ecode = -4;
+        goto err;
+    }
+    for(i = 0; i < n; i++){
+        if(nrf_usb_match(list[i])){
+            nrf_usb_path(list[i], nrfs[nfound].path,
+                    sizeof(nrfs[nfound].path));
+            nfound++;
+        }
+    }
+    libusb_free_device_list(list, 1);
+    list = NULL;
+
+    qsort(nrfs, nfound, sizeof(*nrfs), dev_cmp);
+    for(i = 0; i < nfound; i++){
+        nrfs[i].name = nrfs[i].path;
+        if(open_path(&nrfs[i], nrfs[i].path, false)){
+            fprintf(stderr, "[!] Failed to open %s, skipping it.\n",
+                    nrfs[i].path);
+            continue;
+        }
+        nrf_printf(&nrfs[i], "[*] %s version %s\n", DEVSTRNAME,
+                nrf_version_str(&nrfs[i]));
+        devs[ndevs++] = &nrfs[i];
+    }
+    if(ndevs == 0){
+        fprintf(stderr, "[!] No %04X:%04X devices found.\n", VENDOR_NORDIC,
+                PID_NRF24LU);
+        ecode = -1;
+        goto err;
     }
+
+    ecode = daemon_run(devs, ndevs, sock_path);
+err:
+    if(list){
+        libusb_free_device_list(list, 1);
+    }
+    for(i = 0; i < nfound; i++){
+        nrf_close(&nrfs[i]);
+    }
+    free(devs);
+    free(nrfs);
+    return ecode;
 }
 
 
 int main(int argc, char *argv[]){
-    int c, exit_code, rc;
-    libusb_context *usb = NULL;
-    devp dev = NULL;
-    char *r_fn = NULL, *w_fn = NULL;
-
-    printf("nrfdude v%s, "
+    int c, exit_code = 1, rc, nw = 0, i;
+    struct nrf_dev nrf;
+    devp dev = &nrf;
+    char *r_fn = NULL, *sim_spec = NULL, *sock_path = NULL;
+    char *t_fn = NULL, *c_fn = NULL, *o_fn = NULL, *w_fns[MAX_IMAGES];
+    char *k_fn = NULL, *d_fn = NULL;
+    char *end, *end2;
+    struct nrf_image *img = NULL;
+    struct nrf_sim_config sim_cfg;
+    bool gang = false, line = false, compare_all = false, scan = false;
+    bool ranged = false;
+    struct nrf_fingerprint fp;
+
+    fprintf(stderr, "nrfdude v%s, "
             "(C)2012 Tristan Willy <tristan dot willy@gmail.com>\n",
             VERSION_STRING);
 
-    while((c = getopt(argc, argv, "hxr:w:")) != -1){
+    while((c = getopt(argc, argv, "hxgikLPa:C:c:D:d:j:K:l:o:p:r:s:t:w:"))
+            != -1){
         switch(c){
         case 'h':
             print_help();
             exit(1);
+        case 'a':
+            range_lo = strtoul(optarg, &end, 0);
+            if(end == optarg || *end != '-' ||
+                    (range_hi = strtoul(end + 1, &end2, 0), end2 == end + 1) ||
+                    *end2 || range_lo > range_hi || range_hi >= FLASH_SIZE){
+                fprintf(stderr, "[!] Invalid address range: %s\n", optarg);
+                exit(1);
+            }
+            ranged = true;
+            break;
+        case 'C':
+            compare_all = true;
+            /* fall through */
+        case 'c':
+            c_fn = optarg;
+            break;
+        case 'D':
+            d_fn = optarg;
+            break;
+        case 'd':
+            sock_path = optarg;
+            break;
+        case 'g':
+            gang = true;
+            break;
+        case 'i':
+            scan = true;
+            break;
+        case 'j':
+            journal_fn = optarg;
+            break;
+        case 'K':
+            k_fn = optarg;
+            break;
+        case 'k':
+            if((cache_dir = nrf_cache_default_dir()) == NULL){
+                fprintf(stderr, "[!] No cache directory, set NRFDUDE_CACHE.\n");
+                exit(1);
+            }
+            break;
+        case 'L':
+            line = true;
+            break;
+        case 'l':
+            hex_record_len = atoi(optarg);
+            if(hex_record_len != 16 && hex_record_len != 32 &&
+                    hex_record_len != 64){
+                fprintf(stderr, "[!] Invalid record length: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'o':
+            o_fn = optarg;
+            break;
+        case 'P':
+            plan_only = true;
+            break;
+        case 'p':
+            if(npatches == MAX_PATCHES ||
+                    nrf_patch_parse(&patches[npatches], optarg)){
+                fprintf(stderr, "[!] Invalid or too many patches: %s\n",
+                        optarg);
+                exit(1);
+            }
+            npatches++;
+            break;
         case 'r':
             r_fn = optarg;
             break;
+        case 's':
+            sim_spec = optarg;
+            if(nrf_sim_parse(&sim_cfg, sim_spec)){
+                fprintf(stderr, "[!] Invalid simulator spec: %s\n", sim_spec);
+                exit(1);
+            }
+            break;
+        case 't':
+            t_fn = optarg;
+            if(nrf_trace_open()){
+                fprintf(stderr, "[!] Failed to allocate the trace buffer.\n");
+                exit(1);
+            }
+            break;
         case 'w':
-            w_fn = optarg;
+            if(nw == MAX_IMAGES){
+                fprintf(stderr, "[!] At most %d -w files.\n", MAX_IMAGES);
+                exit(1);
+            }
+            w_fns[nw++] = optarg;
             break;
         case 'x':
             protect_bootloader = false;
             break;
         default:
-            printf("[!] Invalid switch: %c\n", c);
+            fprintf(stderr, "[!] Invalid switch: %c\n", c);
             exit(1);
         }
     }
 
-    if(libusb_init(&usb)){
-        printf("[!] Failed to init libusb.\n");
+    if(ranged && nw && (!addr_valid(range_lo) || !addr_valid(range_hi))){
+        fprintf(stderr,
+                "[!] Address range 0x%04X-0x%04X is invalid or protected.\n",
+                range_lo, range_hi);
+        exit(1);
+    }
+    for(i = 0, c = (c_fn && strcmp(c_fn, "-") == 0) +
+            (d_fn && strcmp(d_fn, "-") == 0); i < nw; i++){
+        c += strcmp(w_fns[i], "-") == 0;
+    }
+    if(c > 1){
+        fprintf(stderr, "[!] Only one file can come from stdin.\n");
+        exit(1);
+    }
+    if((gang || line) && r_fn && strcmp(r_fn, "-") == 0){
+        fprintf(stderr, "[!] Gang dumps go to one file per device.\n");
+        exit(1);
+    }
+    if(scan && (r_fn || nw || c_fn || sock_path || line)){
+        fprintf(stderr, "[!] Inventory scan only reads.\n");
+        exit(1);
+    }
+    if(c_fn && (sock_path || gang || line)){
+        fprintf(stderr, "[!] Compare works on a single device.\n");
+        exit(1);
+    }
+    if(o_fn && (nw == 0 || r_fn || c_fn || sock_path || gang || line ||
+                npatches)){
+        fprintf(stderr, "[!] -o only compiles the -w files.\n");
+        exit(1);
+    }
+    if(npatches && nw == 0){
+        fprintf(stderr, "[!] Patches need an image to patch, see -w.\n");
+        exit(1);
+    }
+    if(sock_path && (gang || line || r_fn || nw)){
+        fprintf(stderr, "[!] Daemon mode takes its jobs from the socket.\n");
+        exit(1);
+    }
+    if(d_fn && r_fn == NULL){
+        fprintf(stderr, "[!] -D needs a dump, see -r.\n");
+        exit(1);
+    }
+    if(plan_only && (nw == 0 || o_fn || sock_path || gang || line)){
+        fprintf(stderr, "[!] -P plans the -w files on a single device.\n");
+        exit(1);
+    }
+    if(k_fn && (gang || line || scan || (sock_path && sim_spec == NULL))){
+        fprintf(stderr, "[!] -K works on a single device.\n");
+        exit(1);
+    }
+    if(line && (gang || r_fn || nw == 0 || sim_spec)){
+        fprintf(stderr,
+                "[!] Production line mode needs -w and real devices only.\n");
         exit(1);
     }
 
-    /* Spamming stdout is NOT OK. */
-    libusb_set_debug(usb, 0);
-
-    if((dev = libusb_open_device_with_vid_pid(usb, VENDOR_NORDIC, PID_NRF24LU))
-            == NULL){
-        printf("[!] Failed to open %04X:%04X.\n", VENDOR_NORDIC, PID_NRF24LU);
+    memset(dev, 0, sizeof(*dev));
+    if(o_fn){
+        if((img = malloc(sizeof(*img))) == NULL ||
+                nrf_load_images(img, w_fns, nw, nrf_write_limit())){
+            goto error;
+        }
+        if((rc = nrf_image_save(img, o_fn))){
+            fprintf(stderr, "[!] Failed to write %s: %d/%s\n", o_fn, rc,
+                    strerror(errno));
+            goto error;
+        }
+        fprintf(stderr, "[*] Compiled %d file(s) into %s\n", nw, o_fn);
+        exit_code = 0;
         goto error;
     }
+    if(d_fn){
+        if((dump_ref = malloc(sizeof(*dump_ref))) == NULL ||
+                nrf_load_reference(dump_ref, &d_fn, 1)){
+            fprintf(stderr, "[!] Failed to load reference %s\n", d_fn);
+            goto error;
+        }
+    }
+    if(sim_spec){
+        if(gang){
+            fprintf(stderr, "[!] Gang mode needs real devices.\n");
+            goto error;
+        }
+        if(nrf_sim_open(dev, &sim_cfg)){
+            fprintf(stderr, "[!] Failed to start the simulated %s.\n",
+                    DEVSTRNAME);
+            goto error;
+        }
+        fprintf(stderr, "[*] Using a simulated %s.\n", DEVSTRNAME);
+    } else {
+        if(libusb_init(&dev->usb)){
+            fprintf(stderr, "[!] Failed to init libusb.\n");
+            exit(1);
+        }
+        dev->tp = &nrf_usb_transport;
+
+        /* Spamming stdout is NOT OK. */
+        libusb_set_debug(dev->usb, 0);
+
+        if(line){
+            if(line_run(dev->usb, w_fns, nw) == 0){
+                fprintf(stderr, "[*] Done.\n");
+                exit_code = 0;
+            }
+            goto error;
+        }
+        if(gang || scan){
+            if(gang_run(dev->usb, r_fn, w_fns, nw, scan) == 0){
+                fprintf(stderr, "[*] Done.\n");
+                exit_code = 0;
+            }
+            goto error;
+        }
+        if(sock_path){
+            if(daemon_usb(dev->usb, sock_path) == 0){
+                exit_code = 0;
+            }
+            goto error;
+        }
+
+        if((dev->handle = libusb_open_device_with_vid_pid(dev->usb,
+                        VENDOR_NORDIC, PID_NRF24LU)) == NULL){
+            fprintf(stderr, "[!] Failed to open %04X:%04X.\n", VENDOR_NORDIC,
+                    PID_NRF24LU);
+            goto error;
+        }
+        if(nrf_setup(dev)){
+            goto error;
+        }
+    }
 
-    /* reset, setup, and claim */
-    if(libusb_reset_device(dev)){
-        printf("[!] Failed to reset device.\n");
-        goto error;
+    fprintf(stderr, "[*] %s version %s\n", DEVSTRNAME, nrf_version_str(dev));
+    if(k_fn && nrf_calib_load(dev, k_fn) == 0){
+        fprintf(stderr, "[*] Loaded calibration from %s\n", k_fn);
     }
-    if(libusb_set_configuration(dev, 1) || libusb_claim_interface(dev, 0)){
-        printf("[!] Failed to set and claim %s.\n", DEVSTRNAME);
-        goto error;
+
+    if(sock_path){
+        if(daemon_run(&dev, 1, sock_path)){
+            goto error;
+        }
     }
 
-    printf("[*] %s version %s\n", DEVSTRNAME, nrf_version_str(dev));
+    /* from here on: 0 all good, 1 something failed, 2 the device differs
+     * from the compare file
+     */
+    exit_code = 0;
+
+    /* a simulated device is scanned on its own */
+    if(scan){
+        rc = scan_device(dev, &fp);
+        scan_print(dev->path, dev->version, &fp, rc);
+        exit_code = rc ? 1 : 0;
+    }
 
     /* reading memory to file */
     if(r_fn){
-        printf("[*] Dumping device to %s\n", r_fn);
-        if((rc = nrf_dump(dev, r_fn))){
-            printf("[!] Failed to dump: %d/%s\n", rc, strerror(errno));
+        fprintf(stderr, "[*] Dumping device to %s\n", r_fn);
+        if((rc = nrf_dump(dev, r_fn, dump_ref))){
+            fprintf(stderr, "[!] Failed to dump: %d/%s\n", rc, strerror(errno));
+            exit_code = 1;
         }
     }
 
     /* writing file to device */
-    if(w_fn){
-        printf("[*] Programming device with %s\n", w_fn);
-        if((rc = nrf_program(dev, w_fn))){
-            printf("[!] Failed to program: %d/%s\n", rc, strerror(errno));
+    if(nw){
+        fprintf(stderr, "[*] %s device with %s",
+                plan_only ? "Planning" : "Programming", w_fns[0]);
+        for(i = 1; i < nw; i++){
+            fprintf(stderr, " + %s", w_fns[i]);
+        }
+        fprintf(stderr, "\n");
+        if((img = malloc(sizeof(*img))) == NULL){
+            rc = -4;
+        } else if((rc = nrf_load_images(img, w_fns, nw,
+                        nrf_write_limit())) == 0){
+            rc = program_patched(dev, img, 0);
+        }
+        if(rc){
+            fprintf(stderr, "[!] Failed to program: %d/%s\n", rc,
+                    strerror(errno));
+            exit_code = 1;
         }
     }
 
-    printf("[*] Done.\n");
-    exit_code = 0;
+    /* comparing device with file */
+    if(c_fn){
+        fprintf(stderr, "[*] Comparing device with %s\n", c_fn);
+        if((rc = nrf_compare(dev, c_fn, compare_all)) == -8){
+            fprintf(stderr, "[!] Device differs from %s\n", c_fn);
+            exit_code = exit_code ? exit_code : 2;
+        } else if(rc){
+            fprintf(stderr, "[!] Failed to compare: %d/%s\n", rc,
+                    strerror(errno));
+            exit_code = 1;
+        } else {
+            fprintf(stderr, "[*] Device matches %s\n", c_fn);
+        }
+    }
+
+    if(k_fn){
+        if(nrf_calib_save(dev, k_fn)){
+            fprintf(stderr, "[!] Failed to save calibration to %s\n", k_fn);
+        } else {
+            fprintf(stderr, "[*] Saved calibration to %s\n", k_fn);
+        }
+    }
+    if(dev->retries){
+        fprintf(stderr, "[*] Recovered from %lu failed transfers.\n",
+                dev->retries);
+    }
+    if(exit_code == 0){
+        fprintf(stderr, "[*] Done.\n");
+    }
 error:
-    if(dev){
-        libusb_release_interface(dev, 0);
-        libusb_close(dev);
+    nrf_close(dev);
+    if(img){
+        free(img);
+    }
+    if(dump_ref){
+        free(dump_ref);
     }
-    if(usb){
-        libusb_exit(usb);
+    for(i = 0; i < npatches; i++){
+        nrf_patch_free(&patches[i]);
+    }
+    if(t_fn){
+        if(nrf_trace_export(t_fn)){
+            fprintf(stderr, "[!] Failed to write trace to %s\n", t_fn);
+        } else {
+            fprintf(stderr, "[*] Traced %lu transfers to %s%s\n",
+                    nrf_trace->n < TRACE_MAX_EVENTS ?
+                        nrf_trace->n : TRACE_MAX_EVENTS, t_fn,
+                    nrf_trace->n > TRACE_MAX_EVENTS ?
+                        " (oldest dropped)" : "");
+        }
+        nrf_trace_close();
     }
     return exit_code;
 }
@@ -0,0 +1,209 @@
+/* patch.c: per-device image patches
+ *
+ * Copyright (C) 2012 Tristan Willy <tristan.willy at gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nrf.h"
+#include "patch.h"
+
+
+/* per-device patches
+ *
+ * A template image is parsed once and each device gets a copy with a few
+ * fields stamped in: a serial number, a radio address, its USB path. A patch
+ * is written as
+ *
+ *   <addr>:<width>:counter[=<start>]   start + device number
+ *   <addr>:<width>:csv=<file>,<col>    column <col> of the device's row
+ *   <addr>:<width>:path                bus-port path
+ *
+ * The caller numbers the devices from 0: in bus/port order in gang mode, in
+ * attach order in production line mode. The n-th device takes the n-th line
+ * of the CSV file, not counting empty lines and lines starting with '#'.
+ * Numbers are stored little endian and must fit in <width> bytes. The
+ * patched bytes join the image like any other, so only the pages they land
+ * on differ from the template. They are stamped in after the -a range has
+ * clipped the image, so a field must lie inside the range or it would be
+ * written outside it.
+ */
+
+
+/* read the lines of fn, less empty ones and # comments */
+static int patch_load_csv(struct nrf_patch *p, const char *fn){
+    FILE *fp;
+    char line[1024], **rows;
+    size_t len;
+
+    if((fp = fopen(fn, "r")) == NULL){
+        return -1;
+    }
+    while(fgets(line, sizeof(line), fp)){
+        len = strcspn(line, "\r\n");
+        line[len] = '\0';
+        if(len == 0 || line[0] == '#'){
+            continue;
+        }
+        if((rows = realloc(p->rows, (p->nrows + 1) * sizeof(*rows))) == NULL){
+            fclose(fp);
+            return -4;
+        }
+        p->rows = rows;
+        if((p->rows[p->nrows] = strdup(line)) == NULL){
+            fclose(fp);
+            return -4;
+        }
+        p->nrows++;
+    }
+    fclose(fp);
+    return p->nrows ? 0 : -1;
+}
+
+
+int nrf_patch_parse(struct nrf_patch *p, const char *spec){
+    char *end, *fn, *comma;
+    unsigned long v;
+    int rc;
+
+    memset(p, 0, sizeof(*p));
+    v = strtoul(spec, &end, 0);
+    if(end == spec || *end != ':' || v >= FLASH_SIZE){
+        return -1;
+    }
+    p->addr = v;
+    spec = end + 1;
+    v = strtoul(spec, &end, 0);
+    if(end == spec || *end != ':' || v < 1 || v > PATCH_MAX_WIDTH ||
+            p->addr + v > FLASH_SIZE){
+        return -1;
+    }
+    p->width = v;
+    spec = end + 1;
+
+    if(strcmp(spec, "path") == 0){
+        p->source = PATCH_PATH;
+        return 0;
+    }
+    if(strncmp(spec, "counter", 7) == 0){
+        p->source = PATCH_COUNTER;
+        if(spec[7] == '\0'){
+            return 0;
+        }
+        p->start = strtoull(&spec[8], &end, 0);
+        return spec[7] != '=' || end == &spec[8] || *end || p->width > 8 ?
+            -1 : 0;
+    }
+    if(strncmp(spec, "csv=", 4) != 0 || (comma = strrchr(spec, ',')) == NULL){
+        return -1;
+    }
+    p->source = PATCH_CSV;
+    p->column = strtol(comma + 1, &end, 10);
+    if(end == comma + 1 || *end || p->column < 1 || p->width > 8){
+        return -1;
+    }
+    if((fn = strndup(&spec[4], comma - &spec[4])) == NULL){
+        return -4;
+    }
+    rc = patch_load_csv(p, fn);
+    free(fn);
+    if(rc){
+        nrf_patch_free(p);
+    }
+    return rc;
+}
+
+
+/* field 'column' (from 1) of a comma separated row, as a number */
+static int patch_csv_value(const char *row, int column,
+        unsigned long long *value){
+    const char *field = row;
+    char *end;
+
+    while(--column){
+        if((field = strchr(field, ',')) == NULL){
+            return -1;
+        }
+        field++;
+    }
+    field += strspn(field, " \t");
+    *value = strtoull(field, &end, 0);
+    end += strspn(end, " \t");
+    return end == field || (*end && *end != ',') ? -1 : 0;
+}
+
+
+/* stamp p into img for device number 'serial' at bus-port 'path'
+ *
+ * Returns -12 if the device has no value or its value does not fit, and -6
+ * if the field lands on invalid or protected flash or outside the -a range.
+ */
+int nrf_patch_apply(const struct nrf_patch *p, struct nrf_image *img,
+        unsigned long serial, const char *path){
+    unsigned char bytes[PATCH_MAX_WIDTH];
+    unsigned long long value = 0;
+    unsigned limit = nrf_write_limit();
+    int i;
+
+    if(p->addr + p->width > limit || p->addr < range_lo ||
+            p->addr + p->width - 1 > range_hi){
+        return -6;
+    }
+    memset(bytes, 0, sizeof(bytes));
+    switch(p->source){
+    case PATCH_PATH:
+        if(strlen(path) > (size_t)p->width){
+            return -12;
+        }
+        memcpy(bytes, path, strlen(path));
+        break;
+    case PATCH_CSV:
+        if(serial >= (unsigned long)p->nrows ||
+                patch_csv_value(p->rows[serial], p->column, &value)){
+            return -12;
+        }
+        break;
+    case PATCH_COUNTER:
+        value = p->start + serial;
+        break;
+    }
+    if(p->source != PATCH_PATH){
+        if(p->width < 8 && value >> (8 * p->width)){
+            return -12;
+        }
+        for(i = 0; i < p->width; i++){
+            bytes[i] = (unsigned char)(value >> (8 * i));
+        }
+    }
+
+    for(i = 0; i < p->width; i++){
+        img->data[p->addr + i] = bytes[i];
+        bitset(img->mask, p->addr + i);
+    }
+    return 0;
+}
+
+
+void nrf_patch_free(struct nrf_patch *p){
+    int i;
+
+    for(i = 0; i < p->nrows; i++){
+        free(p->rows[i]);
+    }
+    free(p->rows);
+    p->rows = NULL;
+    p->nrows = 0;
+}
@@ -0,0 +1,50 @@
+/* patch.h: per-device image patches
+ *
+ * Copyright (C) 2012 Tristan Willy <tristan.willy at gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PATCH_H
+#define PATCH_H
+
+#include "nrf.h"
+
+#define PATCH_MAX_WIDTH     32
+
+
+/* where a patch gets its bytes from */
+enum nrf_patch_source {
+    PATCH_COUNTER,          /* start + device number, little endian */
+    PATCH_CSV,              /* a column of the device's CSV row */
+    PATCH_PATH,             /* bus-port path, NUL padded */
+};
+
+
+/* one field stamped into every device's copy of the image */
+struct nrf_patch {
+    unsigned addr;
+    int width;
+    enum nrf_patch_source source;
+    unsigned long long start;
+    int column;             /* CSV, from 1 */
+    char **rows;            /* CSV, the data lines of the file */
+    int nrows;
+};
+
+int nrf_patch_parse(struct nrf_patch *p, const char *spec);
+int nrf_patch_apply(const struct nrf_patch *p, struct nrf_image *img,
+        unsigned long serial, const char *path);
+void nrf_patch_free(struct nrf_patch *p);
+
+#endif
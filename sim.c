@@ -0,0 +1,603 @@
+/* sim.c: simulated nRF24LU1+ USB loader
+ *
+ * Copyright (C) 2012 Tristan Willy <tristan.willy at gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "nrf.h"
+#include "sim.h"
+
+#define SIM_MAX_RESPONSES   64
+
+
+/* simulated loader
+ *
+ * A software model of Nordic's USB loader sitting behind the transport
+ * interface. It implements the commands nrfdude uses:
+ *
+ *  0x01        : version, answers two bytes
+ *  0x02 <page> : erase the page, then take eight 64-byte data blocks, each
+ *                answered by a status byte. Pages of the loader region are
+ *                refused with status 0xFF and left as they are.
+ *  0x03 <blk>  : read block (MSB * 256 + blk), answers 64 bytes
+ *  0x06 <msb>  : set the block address MSB, answers a status byte
+ *
+ * Flash behaves like flash: an erase sets a page to 0xFF and programming can
+ * only clear bits. The loader region at 0x7800 comes pre-filled so dumps and
+ * write protection have something to look at.
+ *
+ * Timing runs on the real clock so the host code can be timed. Every transfer
+ * completes no earlier than 'latency_us' after it was submitted, which
+ * overlaps between queued transfers, and takes 'xfer_us' of loader time,
+ * which does not. A page erase adds 'erase_us'. OUT transfers are handled
+ * strictly in order and their responses are handed to IN transfers in order,
+ * the same way the real loader and bulk endpoints behave. An IN transfer that
+ * has no response by its timeout fails with NRF_XFER_TIMEOUT, and the
+ * response goes to the next IN transfer once it is ready.
+ */
+struct sim_response {
+    unsigned char data[64];
+    int len;
+    uint64_t issued;        /* submit time of the command */
+    uint64_t ready;
+};
+
+struct nrf_sim {
+    struct nrf_sim_config cfg;
+    unsigned char flash[FLASH_SIZE];
+    int msb;
+    int wpage, wblock;      /* page being written and its next block */
+    struct sim_response resp[SIM_MAX_RESPONSES];
+    int rhead, rcount;
+    struct nrf_xfer *out_head, *out_tail;
+    struct nrf_xfer *in_head, *in_tail;
+    struct nrf_xfer *done_head, *done_tail;
+    uint64_t busy_until;
+    unsigned long xfers;
+    unsigned rng;
+    struct nrf_sim_stats stats;
+};
+
+
+static uint64_t sim_now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static void sim_sleep_until(uint64_t t){
+    struct timespec ts;
+    uint64_t now;
+
+    if((now = sim_now()) < t){
+        ts.tv_sec = (t - now) / 1000000;
+        ts.tv_nsec = ((t - now) % 1000000) * 1000;
+        nanosleep(&ts, NULL);
+    }
+}
+
+
+/* transfer lists */
+static void sim_push(struct nrf_xfer **head, struct nrf_xfer **tail,
+        struct nrf_xfer *x){
+    x->next = NULL;
+    if(*tail){
+        (*tail)->next = x;
+    } else {
+        *head = x;
+    }
+    *tail = x;
+}
+
+
+static struct nrf_xfer *sim_pop(struct nrf_xfer **head,
+        struct nrf_xfer **tail){
+    struct nrf_xfer *x = *head;
+
+    if(x){
+        if((*head = x->next) == NULL){
+            *tail = NULL;
+        }
+        x->next = NULL;
+    }
+    return x;
+}
+
+
+static bool sim_remove(struct nrf_xfer **head, struct nrf_xfer **tail,
+        struct nrf_xfer *x){
+    struct nrf_xfer *prev = NULL, *cur;
+
+    for(cur = *head; cur; prev = cur, cur = cur->next){
+        if(cur == x){
+            if(prev){
+                prev->next = cur->next;
+            } else {
+                *head = cur->next;
+            }
+            if(*tail == cur){
+                *tail = prev;
+            }
+            cur->next = NULL;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/* fault injection, called once per transfer */
+static bool sim_fault(struct nrf_sim *sim){
+    sim->xfers++;
+    if((sim->cfg.fail && sim->xfers == sim->cfg.fail) ||
+            (sim->cfg.flaky && (unsigned)rand_r(&sim->rng) % 1000 <
+             sim->cfg.flaky)){
+        sim->stats.faults++;
+        return true;
+    }
+    return false;
+}
+
+
+/* the loader receives one OUT transfer at time t */
+static void sim_out(struct nrf_sim *sim, struct nrf_xfer *x, uint64_t t){
+    struct sim_response *r;
+    unsigned char *cmd = x->buffer;
+    unsigned addr, block;
+    int i;
+
+    x->actual_length = x->length;
+    if(sim_fault(sim) || sim->rcount == SIM_MAX_RESPONSES){
+        x->status = NRF_XFER_ERROR;
+        return;
+    }
+    x->status = NRF_XFER_OK;
+
+    r = &sim->resp[(sim->rhead + sim->rcount) % SIM_MAX_RESPONSES];
+    r->len = 1;
+    r->data[0] = 0x00;
+    r->issued = x->due - sim->cfg.latency_us;
+    sim->busy_until = t + sim->cfg.xfer_us;
+
+    if(sim->wpage >= 0){
+        /* a data block of the page being written */
+        addr = page2addr(sim->wpage) + sim->wblock * 64;
+        for(i = 0; i < x->length && i < 64; i++){
+            sim->flash[addr + i] &= cmd[i];
+        }
+        if(sim->wpage == sim->cfg.badverify){
+            sim->flash[addr] ^= 0x01;
+        }
+        if(sim->wpage == sim->cfg.badwrite){
+            r->data[0] = 0x01;
+        }
+        sim->stats.blocks++;
+        if(++sim->wblock == 8){
+            sim->wpage = -1;
+        }
+    } else {
+        if(cmd[0] < 8){
+            sim->stats.commands[cmd[0]]++;
+        }
+        switch(cmd[0]){
+        case 0x01:
+            r->len = 2;
+            r->data[0] = 0x01;
+            r->data[1] = 0x00;
+            break;
+        case 0x02:
+            if(x->length < 2 || cmd[1] > 63 ||
+                    cmd[1] >= addr2page(BOOTLOADER_VECTOR)){
+                r->data[0] = 0xFF;
+                break;
+            }
+            memset(&sim->flash[page2addr(cmd[1])], 0xFF, page2addr(1));
+            sim->wpage = cmd[1];
+            sim->wblock = 0;
+            sim->busy_until += sim->cfg.erase_us;
+            if(sim->wpage == sim->cfg.badwrite){
+                r->data[0] = 0x01;
+            }
+            break;
+        case 0x03:
+            block = sim->msb * 0x100 + (x->length < 2 ? 0 : cmd[1]);
+            memcpy(r->data, &sim->flash[block2addr(block)], 64);
+            r->len = 64;
+            break;
+        case 0x06:
+            sim->msb = (x->length < 2) ? 0 : (cmd[1] & 0x01);
+            break;
+        default:
+            r->data[0] = 0xFF;
+            break;
+        }
+    }
+
+    if(sim->cfg.stall &&
+            (unsigned)rand_r(&sim->rng) % 1000 < sim->cfg.stall){
+        /* a crowded hub, everything behind it waits too */
+        sim->busy_until += SIM_STALL_US;
+        sim->stats.faults++;
+    }
+    r->ready = sim->busy_until;
+    sim->rcount++;
+}
+
+
+/* the oldest response goes out on one IN transfer at time t */
+static void sim_in(struct nrf_sim *sim, struct nrf_xfer *x, uint64_t t){
+    struct sim_response *r = &sim->resp[sim->rhead];
+
+    sim->rhead = (sim->rhead + 1) % SIM_MAX_RESPONSES;
+    sim->rcount--;
+
+    if(sim_fault(sim)){
+        /* the response is lost with the transfer */
+        x->status = NRF_XFER_ERROR;
+        x->actual_length = 0;
+        return;
+    }
+    if(r->len > x->length){
+        /* babble, like a real short buffer would see */
+        memcpy(x->buffer, r->data, x->length);
+        x->actual_length = x->length;
+        x->status = NRF_XFER_ERROR;
+    } else {
+        memcpy(x->buffer, r->data, r->len);
+        x->actual_length = r->len;
+        x->status = NRF_XFER_OK;
+    }
+    sim->stats.latency[sim->stats.nlatency++ % SIM_MAX_LATENCIES] =
+        (uint32_t)(t - r->issued);
+}
+
+
+/* when the next transfer is due and which list it comes off
+ *
+ * Sets *t and returns 'o' (OUT), 'i' (IN), 't' (IN timed out), or 0 if
+ * nothing is in flight.
+ */
+static int sim_next(struct nrf_sim *sim, uint64_t *t){
+    uint64_t t_out = UINT64_MAX, t_in = UINT64_MAX, t_late = UINT64_MAX;
+
+    if(sim->out_head){
+        t_out = sim->out_head->due;
+        if(t_out < sim->busy_until){
+            t_out = sim->busy_until;
+        }
+    }
+    if(sim->in_head && sim->rcount){
+        t_in = sim->in_head->due;
+        if(t_in < sim->resp[sim->rhead].ready){
+            t_in = sim->resp[sim->rhead].ready;
+        }
+    }
+    if(sim->in_head){
+        t_late = sim->in_head->due - sim->cfg.latency_us + 1000ULL *
+            (sim->in_head->timeout ? sim->in_head->timeout : TIMEOUT);
+    }
+
+    if(t_in == UINT64_MAX && t_out == UINT64_MAX && t_late == UINT64_MAX){
+        return 0;
+    } else if(t_late < t_in && t_late < t_out){
+        *t = t_late;
+        return 't';
+    } else if(t_in <= t_out){
+        *t = t_in;
+        return 'i';
+    }
+    *t = t_out;
+    return 'o';
+}
+
+
+/* complete the next transfer, sleeping until it is due
+ * returns -1 if nothing is in flight
+ */
+static int sim_step(struct nrf_sim *sim){
+    struct nrf_xfer *x;
+    uint64_t t;
+
+    switch(sim_next(sim, &t)){
+    case 't':
+        /* nothing answered in time */
+        x = sim_pop(&sim->in_head, &sim->in_tail);
+        sim_sleep_until(t);
+        x->status = NRF_XFER_TIMEOUT;
+        x->actual_length = 0;
+        break;
+    case 'i':
+        x = sim_pop(&sim->in_head, &sim->in_tail);
+        sim_sleep_until(t);
+        sim_in(sim, x, t);
+        break;
+    case 'o':
+        x = sim_pop(&sim->out_head, &sim->out_tail);
+        sim_sleep_until(t);
+        sim_out(sim, x, t);
+        break;
+    default:
+        return -1;
+    }
+    sim->stats.transfers++;
+    x->callback(x);
+    return 0;
+}
+
+
+/* transport */
+static int sim_xfer_init(struct nrf_xfer *x){
+    return 0;
+}
+
+
+static void sim_xfer_free(struct nrf_xfer *x){
+}
+
+
+static int sim_submit(struct nrf_xfer *x){
+    struct nrf_sim *sim = (struct nrf_sim *)x->dev->tp_data;
+
+    x->due = sim_now() + sim->cfg.latency_us;
+    if(x->endpoint & 0x80){
+        sim_push(&sim->in_head, &sim->in_tail, x);
+    } else {
+        sim_push(&sim->out_head, &sim->out_tail, x);
+    }
+    return 0;
+}
+
+
+static int sim_cancel(struct nrf_xfer *x){
+    struct nrf_sim *sim = (struct nrf_sim *)x->dev->tp_data;
+
+    if(!sim_remove(&sim->in_head, &sim->in_tail, x) &&
+            !sim_remove(&sim->out_head, &sim->out_tail, x)){
+        /* already done */
+        return -1;
+    }
+    x->status = NRF_XFER_CANCELLED;
+    x->actual_length = 0;
+    sim_push(&sim->done_head, &sim->done_tail, x);
+    return 0;
+}
+
+
+static int sim_wait(devp dev, int *completed){
+    struct nrf_sim *sim = (struct nrf_sim *)dev->tp_data;
+    struct nrf_xfer *x;
+
+    while(!*completed){
+        if((x = sim_pop(&sim->done_head, &sim->done_tail))){
+            x->callback(x);
+        } else if(sim_step(sim)){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/* complete whatever is due by now, never sleeping */
+static int sim_poll(devp dev, int *timeout){
+    struct nrf_sim *sim = (struct nrf_sim *)dev->tp_data;
+    struct nrf_xfer *x;
+    uint64_t t, now;
+    int n = 0;
+
+    while((x = sim_pop(&sim->done_head, &sim->done_tail))){
+        x->callback(x);
+        n++;
+    }
+    now = sim_now();
+    while(sim_next(sim, &t) && t <= now){
+        sim_step(sim);
+        n++;
+    }
+    if(sim_next(sim, &t) == 0){
+        *timeout = -1;
+    } else {
+        /* round up so the caller does not wake just before it is due */
+        now = sim_now();
+        *timeout = (t <= now) ? 0 : (int)((t - now + 999) / 1000);
+    }
+    return n;
+}
+
+
+static void sim_bulk_cb(struct nrf_xfer *x){
+    *(int *)x->user_data = 1;
+}
+
+
+static int sim_bulk(devp dev, unsigned char endpoint, void *data, int length,
+        int timeout){
+    struct nrf_xfer x;
+    int done = 0;
+
+    memset(&x, 0, sizeof(x));
+    x.dev = dev;
+    x.endpoint = endpoint;
+    x.buffer = (unsigned char *)data;
+    x.length = length;
+    x.timeout = timeout;
+    x.callback = sim_bulk_cb;
+    x.user_data = &done;
+    sim_submit(&x);
+    if(sim_wait(dev, &done)){
+        return LIBUSB_ERROR_IO;
+    } else if(x.status == NRF_XFER_TIMEOUT){
+        return LIBUSB_ERROR_TIMEOUT;
+    } else if(x.status != NRF_XFER_OK){
+        return LIBUSB_ERROR_IO;
+    }
+    return 0;
+}
+
+
+static void sim_close(devp dev){
+    free(dev->tp_data);
+    dev->tp_data = NULL;
+}
+
+
+const struct nrf_transport nrf_sim_transport = {
+    "sim",
+    sim_xfer_init,
+    sim_xfer_free,
+    sim_submit,
+    sim_cancel,
+    sim_wait,
+    sim_bulk,
+    sim_poll,
+    sim_close,
+};
+
+
+/* parse a simulator spec: comma separated key=value pairs
+ *
+ *  latency=<us>    host/hub turnaround per transfer
+ *  xfer=<us>       loader time per transfer
+ *  erase=<us>      page erase time
+ *  fail=<n>        fail the n-th transfer
+ *  flaky=<n>       fail n out of 1000 transfers at random
+ *  stall=<n>       n out of 1000 responses come SIM_STALL_US late
+ *  seed=<n>        random seed for flaky and stall
+ *  badwrite=<page> writes to page report a bad status
+ *  badverify=<page> page does not hold what is written to it
+ *  image=<file>    raw 32 KiB initial flash contents
+ *
+ * An empty spec or "default" is an ideal loader with blank flash.
+ */
+int nrf_sim_parse(struct nrf_sim_config *cfg, const char *spec){
+    char buf[512], *tok, *save, *val, *end;
+    unsigned long n;
+
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->seed = 1;
+    cfg->badwrite = cfg->badverify = -1;
+
+    if(strlen(spec) >= sizeof(buf)){
+        return -1;
+    }
+    strcpy(buf, spec);
+    for(tok = strtok_r(buf, ",", &save); tok;
+            tok = strtok_r(NULL, ",", &save)){
+        if(strcmp(tok, "default") == 0){
+            continue;
+        }
+        if((val = strchr(tok, '=')) == NULL){
+            return -1;
+        }
+        *val++ = '\0';
+        if(strcmp(tok, "image") == 0){
+            if(strlen(val) >= sizeof(cfg->image)){
+                return -1;
+            }
+            strcpy(cfg->image, val);
+            continue;
+        }
+        n = strtoul(val, &end, 0);
+        if(*val == '\0' || *end != '\0'){
+            return -1;
+        }
+        if(strcmp(tok, "latency") == 0){
+            cfg->latency_us = n;
+        } else if(strcmp(tok, "xfer") == 0){
+            cfg->xfer_us = n;
+        } else if(strcmp(tok, "erase") == 0){
+            cfg->erase_us = n;
+        } else if(strcmp(tok, "fail") == 0){
+            cfg->fail = n;
+        } else if(strcmp(tok, "flaky") == 0){
+            cfg->flaky = n;
+        } else if(strcmp(tok, "stall") == 0){
+            cfg->stall = n;
+        } else if(strcmp(tok, "seed") == 0){
+            cfg->seed = n;
+        } else if(strcmp(tok, "badwrite") == 0 && n < 64){
+            cfg->badwrite = n;
+        } else if(strcmp(tok, "badverify") == 0 && n < 64){
+            cfg->badverify = n;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/* attach dev to a fresh simulated loader */
+int nrf_sim_open(devp dev, const struct nrf_sim_config *cfg){
+    struct nrf_sim *sim;
+    FILE *fp;
+    unsigned addr;
+
+    if((sim = calloc(1, sizeof(*sim))) == NULL){
+        return -4;
+    }
+    sim->cfg = *cfg;
+    sim->wpage = -1;
+    sim->rng = cfg->seed;
+
+    memset(sim->flash, 0xFF, FLASH_SIZE);
+    if(cfg->image[0]){
+        if((fp = fopen(cfg->image, "rb")) == NULL){
+            free(sim);
+            return -1;
+        }
+        if(fread(sim->flash, 1, FLASH_SIZE, fp) != FLASH_SIZE){
+            fclose(fp);
+            free(sim);
+            return -1;
+        }
+        fclose(fp);
+    } else {
+        /* something that looks like a loader: LJMP to itself, then noise */
+        for(addr = BOOTLOADER_VECTOR; addr < FLASH_SIZE; addr++){
+            sim->flash[addr] = (unsigned char)(addr * 7 + 0x5A);
+        }
+        sim->flash[BOOTLOADER_VECTOR] = 0x02;
+        sim->flash[BOOTLOADER_VECTOR + 1] = BOOTLOADER_VECTOR >> 8;
+        sim->flash[BOOTLOADER_VECTOR + 2] = BOOTLOADER_VECTOR & 0xFF;
+    }
+
+    dev->tp = &nrf_sim_transport;
+    dev->tp_data = sim;
+    dev->msb = -1;
+    snprintf(dev->path, sizeof(dev->path), "sim");
+    return 0;
+}
+
+
+struct nrf_sim_stats *nrf_sim_stats(devp dev){
+    if(dev->tp != &nrf_sim_transport){
+        return NULL;
+    }
+    return &((struct nrf_sim *)dev->tp_data)->stats;
+}
+
+
+unsigned char *nrf_sim_flash(devp dev){
+    if(dev->tp != &nrf_sim_transport){
+        return NULL;
+    }
+    return ((struct nrf_sim *)dev->tp_data)->flash;
+}
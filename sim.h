@@ -0,0 +1,65 @@
+/* sim.h: simulated nRF24LU1+ USB loader
+ *
+ * Copyright (C) 2012 Tristan Willy <tristan.willy at gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include "nrf.h"
+
+#define SIM_MAX_LATENCIES   65536
+#define SIM_STALL_US        500000
+
+
+/* simulated loader settings, see nrf_sim_parse() */
+struct nrf_sim_config {
+    unsigned latency_us;    /* host/hub turnaround per transfer, overlaps */
+    unsigned xfer_us;       /* bus time per transfer, serialized */
+    unsigned erase_us;      /* page erase time of 0x02 */
+    unsigned long fail;     /* fail this transfer (1 is the first), 0: never */
+    unsigned flaky;         /* random transfer failures per 1000 */
+    unsigned stall;         /* responses per 1000 that come SIM_STALL_US late */
+    unsigned seed;
+    int badwrite;           /* page whose writes report a bad status, or -1 */
+    int badverify;          /* page that does not hold its data, or -1 */
+    char image[256];        /* raw 32 KiB initial flash contents */
+};
+
+
+/* what the simulated loader saw
+ *
+ * 'latency' holds the time from submitting each command to the completion of
+ * its response, in microseconds, wrapping after SIM_MAX_LATENCIES commands.
+ */
+struct nrf_sim_stats {
+    unsigned long transfers;
+    unsigned long commands[8];  /* by opcode, 0x00-0x07 */
+    unsigned long blocks;       /* data blocks written */
+    unsigned long faults;
+    unsigned long nlatency;
+    uint32_t latency[SIM_MAX_LATENCIES];
+};
+
+
+int nrf_sim_parse(struct nrf_sim_config *cfg, const char *spec);
+int nrf_sim_open(devp dev, const struct nrf_sim_config *cfg);
+struct nrf_sim_stats *nrf_sim_stats(devp dev);
+unsigned char *nrf_sim_flash(devp dev);
+
+extern const struct nrf_transport nrf_sim_transport;
+
+#endif
@@ -0,0 +1,175 @@
+/* trace.c: USB transfer tracing
+ *
+ * Copyright (C) 2012 Tristan Willy <tristan.willy at gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "nrf.h"
+#include "trace.h"
+
+#define TRACE_MAX_DEVS      64
+
+
+/* transfer tracing
+ *
+ * Every transfer of every device, synchronous or queued, is recorded when it
+ * completes into one preallocated ring, so tracing never allocates on the
+ * transfer path. The ring is written out once at the end, as Chrome trace
+ * event JSON (chrome://tracing, Perfetto) if the file name ends in ".json",
+ * otherwise as CSV.
+ */
+struct nrf_trace *nrf_trace = NULL;
+
+static const char *status_names[] = {"ok", "error", "timeout", "cancelled"};
+
+
+int nrf_trace_open(void){
+    if(nrf_trace){
+        return 0;
+    }
+    if((nrf_trace = calloc(1, sizeof(*nrf_trace))) == NULL){
+        return -4;
+    }
+    pthread_mutex_init(&nrf_trace->lock, NULL);
+    return 0;
+}
+
+
+uint64_t nrf_trace_now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* record a transfer that started at 'start' and just completed */
+void nrf_trace_record(devp dev, unsigned char endpoint, unsigned char opcode,
+        int length, int rc, enum nrf_xfer_status status, uint64_t start){
+    struct nrf_trace_event *e;
+    uint64_t end = nrf_trace_now();
+
+    pthread_mutex_lock(&nrf_trace->lock);
+    e = &nrf_trace->ev[nrf_trace->n++ % TRACE_MAX_EVENTS];
+    e->start = start;
+    e->end = end;
+    snprintf(e->dev, sizeof(e->dev), "%s",
+            dev->name ? dev->name : dev->path[0] ? dev->path : "nrf");
+    e->endpoint = endpoint;
+    e->opcode = opcode;
+    e->length = length;
+    e->rc = rc;
+    e->status = status;
+    pthread_mutex_unlock(&nrf_trace->lock);
+}
+
+
+/* Chrome trace events, one process per device */
+static int trace_write_json(FILE *fp, unsigned long first, unsigned long n,
+        uint64_t base){
+    const struct nrf_trace_event *e;
+    char devs[TRACE_MAX_DEVS][32];
+    int ndevs = 0, pid;
+    unsigned long i;
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for(i = 0; i < n; i++){
+        e = &nrf_trace->ev[(first + i) % TRACE_MAX_EVENTS];
+        for(pid = 0; pid < ndevs && strcmp(devs[pid], e->dev); pid++);
+        if(pid == ndevs && ndevs < TRACE_MAX_DEVS){
+            strcpy(devs[ndevs++], e->dev);
+            fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                    "\"args\":{\"name\":\"%s\"}},\n", pid + 1, e->dev);
+        }
+        fprintf(fp, "{\"name\":\"0x%02X %s\",\"cat\":\"usb\",\"ph\":\"b\","
+                "\"id\":%lu,\"pid\":%d,\"tid\":%d,\"ts\":%.3f,"
+                "\"args\":{\"endpoint\":\"0x%02X\",\"length\":%d,"
+                "\"status\":\"%s\",\"rc\":%d}},\n",
+                e->opcode, e->endpoint == IN ? "IN" : "OUT", first + i,
+                pid + 1, e->endpoint, (e->start - base) / 1e3, e->endpoint,
+                e->length, status_names[e->status], e->rc);
+        fprintf(fp, "{\"name\":\"0x%02X %s\",\"cat\":\"usb\",\"ph\":\"e\","
+                "\"id\":%lu,\"pid\":%d,\"tid\":%d,\"ts\":%.3f}%s\n",
+                e->opcode, e->endpoint == IN ? "IN" : "OUT", first + i,
+                pid + 1, e->endpoint, (e->end - base) / 1e3,
+                i + 1 < n ? "," : "");
+    }
+    fprintf(fp, "]}\n");
+    return 0;
+}
+
+
+static int trace_write_csv(FILE *fp, unsigned long first, unsigned long n,
+        uint64_t base){
+    const struct nrf_trace_event *e;
+    unsigned long i;
+
+    fprintf(fp, "dev,endpoint,opcode,length,status,rc,start_us,duration_us\n");
+    for(i = 0; i < n; i++){
+        e = &nrf_trace->ev[(first + i) % TRACE_MAX_EVENTS];
+        fprintf(fp, "%s,0x%02X,0x%02X,%d,%s,%d,%.3f,%.3f\n", e->dev,
+                e->endpoint, e->opcode, e->length, status_names[e->status],
+                e->rc, (e->start - base) / 1e3, (e->end - e->start) / 1e3);
+    }
+    return 0;
+}
+
+
+/* write out the ring, oldest transfer first */
+int nrf_trace_export(const char *fn){
+    unsigned long first, n, i;
+    uint64_t base = UINT64_MAX;
+    size_t len = strlen(fn);
+    FILE *fp;
+    int ecode;
+
+    if(nrf_trace == NULL){
+        return -1;
+    }
+    if((fp = fopen(fn, "w")) == NULL){
+        return -1;
+    }
+    pthread_mutex_lock(&nrf_trace->lock);
+    n = nrf_trace->n < TRACE_MAX_EVENTS ? nrf_trace->n : TRACE_MAX_EVENTS;
+    first = nrf_trace->n - n;
+    /* completion order, so the earliest start can be anywhere */
+    for(i = 0; i < n; i++){
+        if(nrf_trace->ev[(first + i) % TRACE_MAX_EVENTS].start < base){
+            base = nrf_trace->ev[(first + i) % TRACE_MAX_EVENTS].start;
+        }
+    }
+    if(len > 5 && strcmp(fn + len - 5, ".json") == 0){
+        ecode = trace_write_json(fp, first, n, base);
+    } else {
+        ecode = trace_write_csv(fp, first, n, base);
+    }
+    pthread_mutex_unlock(&nrf_trace->lock);
+    if(fclose(fp)){
+        ecode = -3;
+    }
+    return ecode;
+}
+
+
+void nrf_trace_close(void){
+    if(nrf_trace){
+        pthread_mutex_destroy(&nrf_trace->lock);
+        free(nrf_trace);
+        nrf_trace = NULL;
+    }
+}
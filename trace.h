@@ -0,0 +1,64 @@
+/* trace.h: USB transfer tracing
+ *
+ * Copyright (C) 2012 Tristan Willy <tristan.willy at gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "nrf.h"
+
+#define TRACE_MAX_EVENTS    65536
+
+
+/* one transfer
+ *
+ * 'status' is the outcome, 'rc' the transport's return code, for queued
+ * transfers the libusb code matching 'status'. 'opcode' is the loader command
+ * the transfer belongs to, for IN transfers that of the command it answers,
+ * and 0x00 for the data blocks of a page write.
+ */
+struct nrf_trace_event {
+    uint64_t start, end;            /* CLOCK_MONOTONIC, ns */
+    char dev[32];                   /* device name or bus-port path */
+    unsigned char endpoint;
+    unsigned char opcode;
+    int length;
+    int rc;
+    enum nrf_xfer_status status;
+};
+
+
+/* ring of the last TRACE_MAX_EVENTS transfers of every device */
+struct nrf_trace {
+    pthread_mutex_t lock;
+    unsigned long n;                /* events recorded, the ring wraps */
+    struct nrf_trace_event ev[TRACE_MAX_EVENTS];
+};
+
+
+/* NULL while tracing is off, so the hooks cost one test */
+extern struct nrf_trace *nrf_trace;
+
+int nrf_trace_open(void);
+uint64_t nrf_trace_now(void);
+void nrf_trace_record(devp dev, unsigned char endpoint, unsigned char opcode,
+        int length, int rc, enum nrf_xfer_status status, uint64_t start);
+int nrf_trace_export(const char *fn);
+void nrf_trace_close(void);
+
+#endif
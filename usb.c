@@ -0,0 +1,189 @@
+/* usb.c: libusb transport for the nRF24LU1+ loader
+ *
+ * Copyright (C) 2012 Tristan Willy <tristan.willy at gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <libusb.h>
+#include "nrf.h"
+
+
+/* bus-port path of a USB device, such as "1-2.3" */
+void nrf_usb_path(libusb_device *usbdev, char *path, size_t len){
+    uint8_t ports[7];
+    int n, i, pos;
+
+    pos = snprintf(path, len, "%d", libusb_get_bus_number(usbdev));
+    n = libusb_get_port_numbers(usbdev, ports, sizeof(ports));
+    for(i = 0; i < n && pos > 0 && (size_t)pos < len; i++){
+        pos += snprintf(&path[pos], len - pos, "%c%d", i ? '.' : '-',
+                ports[i]);
+    }
+}
+
+
+bool nrf_usb_match(libusb_device *usbdev){
+    struct libusb_device_descriptor desc;
+
+    return libusb_get_device_descriptor(usbdev, &desc) == 0 &&
+        desc.idVendor == VENDOR_NORDIC && desc.idProduct == PID_NRF24LU;
+}
+
+
+/* reset, setup, and claim an opened loader */
+int nrf_setup(devp dev){
+    dev->tp = &nrf_usb_transport;
+    nrf_usb_path(libusb_get_device(dev->handle), dev->path, sizeof(dev->path));
+    if(libusb_reset_device(dev->handle)){
+        nrf_printf(dev, "[!] Failed to reset device.\n");
+        return -1;
+    }
+    /* nothing says a bus reset clears the loader's address MSB, so the first
+     * block access sets it
+     */
+    dev->msb = -1;
+    if(libusb_set_configuration(dev->handle, 1) ||
+            libusb_claim_interface(dev->handle, 0)){
+        nrf_printf(dev, "[!] Failed to set and claim %s.\n", DEVSTRNAME);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* transport
+ *
+ * Each nrf_xfer carries a libusb_transfer in 'priv'. Completions are handled
+ * on the device's own libusb context.
+ */
+static void usb_cb(struct libusb_transfer *t){
+    struct nrf_xfer *x = (struct nrf_xfer *)t->user_data;
+
+    x->actual_length = t->actual_length;
+    switch(t->status){
+    case LIBUSB_TRANSFER_COMPLETED:
+        x->status = NRF_XFER_OK;
+        break;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        x->status = NRF_XFER_TIMEOUT;
+        break;
+    case LIBUSB_TRANSFER_CANCELLED:
+        x->status = NRF_XFER_CANCELLED;
+        break;
+    default:
+        x->status = NRF_XFER_ERROR;
+        break;
+    }
+    x->callback(x);
+}
+
+
+static int usb_xfer_init(struct nrf_xfer *x){
+    if((x->priv = libusb_alloc_transfer(0)) == NULL){
+        return -1;
+    }
+    return 0;
+}
+
+
+static void usb_xfer_free(struct nrf_xfer *x){
+    /* libusb_free_transfer() accepts NULL */
+    libusb_free_transfer((struct libusb_transfer *)x->priv);
+    x->priv = NULL;
+}
+
+
+static int usb_submit(struct nrf_xfer *x){
+    struct libusb_transfer *t = (struct libusb_transfer *)x->priv;
+
+    libusb_fill_bulk_transfer(t, x->dev->handle, x->endpoint, x->buffer,
+            x->length, usb_cb, x, x->timeout ? x->timeout : TIMEOUT);
+    return libusb_submit_transfer(t);
+}
+
+
+static int usb_cancel(struct nrf_xfer *x){
+    return libusb_cancel_transfer((struct libusb_transfer *)x->priv);
+}
+
+
+static int usb_wait(devp dev, int *completed){
+    int rc;
+
+    rc = libusb_handle_events_completed(dev->usb, completed);
+    return (rc == LIBUSB_ERROR_INTERRUPTED) ? 0 : rc;
+}
+
+
+static int usb_bulk(devp dev, unsigned char endpoint, void *data, int length,
+        int timeout){
+    int trans;
+
+    return libusb_bulk_transfer(dev->handle, endpoint, data, length, &trans,
+            timeout);
+}
+
+
+/* handle whatever events are ready, never blocking
+ *
+ * libusb does not say how many callbacks ran, so the count comes from the
+ * queue's own, see nrf_queue_cb(). The next libusb timeout is the only
+ * deadline, everything else arrives on the context's poll fds.
+ */
+static int usb_poll(devp dev, int *timeout){
+    struct timeval tv = {0, 0};
+    unsigned long before = dev->completed;
+    int rc;
+
+    rc = libusb_handle_events_timeout_completed(dev->usb, &tv, NULL);
+    if(rc && rc != LIBUSB_ERROR_INTERRUPTED){
+        return rc;
+    }
+    if(libusb_get_next_timeout(dev->usb, &tv) == 1){
+        *timeout = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+    } else {
+        *timeout = -1;
+    }
+    return (int)(dev->completed - before);
+}
+
+
+/* release and close a loader, including its libusb context */
+static void usb_close(devp dev){
+    if(dev->handle){
+        libusb_release_interface(dev->handle, 0);
+        libusb_close(dev->handle);
+        dev->handle = NULL;
+    }
+    if(dev->usb){
+        libusb_exit(dev->usb);
+        dev->usb = NULL;
+    }
+}
+
+
+const struct nrf_transport nrf_usb_transport = {
+    "usb",
+    usb_xfer_init,
+    usb_xfer_free,
+    usb_submit,
+    usb_cancel,
+    usb_wait,
+    usb_bulk,
+    usb_poll,
+    usb_close,
+};